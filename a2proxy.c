@@ -0,0 +1,962 @@
+/******************************************************************************
+
+Copyright (c) 2022, Oliver Schmidt
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the <organization> nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL OLIVER SCHMIDT BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+******************************************************************************/
+
+#define _GNU_SOURCE
+#include <poll.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <zlib.h>
+
+//
+// This caching proxy allows many Apple IIs on a LAN to share a single
+// download of a .A2Stream file from a remote HTTP server. The players use
+// URLs of the form
+//
+//   http://<proxy>:<port>/<origin host>[:<origin port>]/<origin path>
+//
+// The first request for a file has a downloader process fetch it from the
+// origin server in segments using HTTP range requests. The segments are
+// appended to <file>.part in the cache directory. Once the download is
+// complete, <file>.part is renamed to <file>. A response body is only taken
+// as complete if it has the length given by Content-Length or by the chunked
+// encoding, a body ending early leaves <file>.part to be resumed.
+//
+// Every client is served from the cache file - even while the download is
+// still in progress. So all clients requesting the same file share the one
+// download, no matter when they start.
+//
+// The downloader holds an exclusive lock on <file>.part. If a client finds
+// <file>.part unlocked, the downloader is gone and the client starts a new
+// one, which resumes where the previous one stopped. This is also how an
+// interrupted download is resumed after a restart of the proxy.
+//
+// Playback statistics sent by A2Stream at the end of a stream are logged.
+//
+// In order not to be an open relay, the proxy only connects to the origin
+// servers given on the command line - or to port 80 if there are none.
+//
+// Origin servers not supporting range requests are handled as well, they
+// just don't allow to resume a download without fetching it from the start.
+//
+// Additionally the proxy serves an archive of files itself: If the cache
+// directory contains a subdirectory named like the <origin host> (without
+// <origin port>), the file is taken from that subdirectory instead. There a
+// .A2Stream file may be stored as .A2SZ file generated by gena2stream -z.
+// The .A2SZ file consists of independently compressed frames, so the proxy
+// only decompresses the frames covering the requested part of the .A2Stream
+// file. This part is either the whole file or a single HTTP byte range.
+//
+
+#define PROXY_PORT   "8080"
+#define SEGMENT_SIZE 0x100000  // multiple of the 256-byte chunk size
+#define HEADER_MAX   0x800
+#define RETRY_MAX    3         // downloader restarts per client
+#define POLL_MSECS   100
+#define STATS_WAIT   60        // seconds to wait for playback statistics
+
+static const char *cache_dir;
+static char **origins;  // allowed origin servers
+static int num_origins;
+
+static bool send_all(int sock, const char *buf, size_t len)
+{
+  while (len)
+  {
+    ssize_t n = send(sock, buf, len, MSG_NOSIGNAL);
+    if (n <= 0)
+    {
+      return false;
+    }
+    buf += n;
+    len -= n;
+  }
+  return true;
+}
+
+// Read an HTTP header up to and including the empty line. Everything after
+// the header is left in the socket.
+static bool recv_header(int sock, char *buf, size_t size)
+{
+  size_t len = 0;
+
+  while (len < size - 1)
+  {
+    if (recv(sock, buf + len, 1, 0) != 1)
+    {
+      return false;
+    }
+    buf[++len] = '\0';
+    if (len >= 4 && !memcmp(buf + len - 4, "\r\n\r\n", 4))
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Read a line up to and including CRLF, which is stripped
+static bool recv_line(int sock, char *buf, size_t size)
+{
+  size_t len = 0;
+
+  while (len < size - 1)
+  {
+    if (recv(sock, buf + len, 1, 0) != 1)
+    {
+      return false;
+    }
+    buf[++len] = '\0';
+    if (len >= 2 && !memcmp(buf + len - 2, "\r\n", 2))
+    {
+      buf[len - 2] = '\0';
+      return true;
+    }
+  }
+  return false;
+}
+
+static const char *header_field(const char *header, const char *name)
+{
+  size_t len = strlen(name);
+  const char *line = strstr(header, "\r\n");
+
+  while (line && line[2] != '\r')
+  {
+    line += 2;
+    if (!strncasecmp(line, name, len) && line[len] == ':')
+    {
+      return line + len + 1;
+    }
+    line = strstr(line, "\r\n");
+  }
+  return NULL;
+}
+
+static int connect_origin(const char *host, const char *port)
+{
+  struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+  struct addrinfo *list, *addr;
+  int sock = -1;
+
+  if (getaddrinfo(host, port, &hints, &list))
+  {
+    return -1;
+  }
+  for (addr = list; addr; addr = addr->ai_next)
+  {
+    sock = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+    if (sock == -1)
+    {
+      continue;
+    }
+    if (!connect(sock, addr->ai_addr, addr->ai_addrlen))
+    {
+      break;
+    }
+    close(sock);
+    sock = -1;
+  }
+  freeaddrinfo(list);
+  return sock;
+}
+
+// Copy <len> bytes (or everything up to EOF if <len> is -1) from <sock> to
+// <file>. Discard the first <skip> bytes.
+static bool copy_body(int sock, int file, int64_t skip, int64_t len)
+{
+  char buf[0x4000];
+
+  while (len)
+  {
+    size_t size = len > 0 && len < (int64_t)sizeof(buf) ? (size_t)len
+                                                        : sizeof(buf);
+    ssize_t n = recv(sock, buf, size, 0);
+    if (n <= 0)
+    {
+      return len < 0 && !n;
+    }
+    if (len > 0)
+    {
+      len -= n;
+    }
+    if (skip >= n)
+    {
+      skip -= n;
+      continue;
+    }
+    if (write(file, buf + skip, n - skip) != n - skip)
+    {
+      return false;
+    }
+    skip = 0;
+  }
+  return true;
+}
+
+// Copy a chunked body of <len> bytes (or of any length if <len> is -1) from
+// <sock> to <file>. Discard the first <skip> bytes.
+static bool copy_chunked(int sock, int file, int64_t skip, int64_t len)
+{
+  char line[0x40];
+  uint64_t size;
+
+  while (true)
+  {
+    if (!recv_line(sock, line, sizeof(line)) ||
+        sscanf(line, "%" SCNx64, &size) != 1 || size > INT64_MAX)
+    {
+      return false;
+    }
+    if (!size)
+    {
+      // The trailer is of no interest
+      return len <= 0;
+    }
+    if (len >= 0 && (int64_t)size > len)
+    {
+      return false;
+    }
+    if (!copy_body(sock, file, skip, (int64_t)size) ||
+        !recv_line(sock, line, sizeof(line)) || *line)
+    {
+      return false;
+    }
+    skip = skip > (int64_t)size ? skip - (int64_t)size : 0;
+    if (len > 0)
+    {
+      len -= size;
+    }
+  }
+}
+
+// Copy the body of the response with <header> from <sock> to <file> like
+// copy_body(). The body is delimited by chunked encoding, by Content-Length
+// or - only if neither is present - by <len>. A body ending early fails.
+static bool copy_response(int sock, const char *header, int file,
+                          int64_t skip, int64_t len)
+{
+  const char *field = header_field(header, "Transfer-Encoding");
+  char coding[0x40];
+  int64_t length;
+
+  if (field && sscanf(field, " %63[^\r]", coding) == 1 &&
+      strcasestr(coding, "chunked"))
+  {
+    return copy_chunked(sock, file, skip, len);
+  }
+  field = header_field(header, "Content-Length");
+  if (field)
+  {
+    if (sscanf(field, " %" SCNd64, &length) != 1 || length < 0 ||
+        (len >= 0 && length != len))
+    {
+      return false;
+    }
+    len = length;
+  }
+  return copy_body(sock, file, skip, len);
+}
+
+static bool download(int file, const char *host, const char *port,
+                     const char *path)
+{
+  int64_t offset = lseek(file, 0, SEEK_END);
+
+  while (true)
+  {
+    char header[HEADER_MAX];
+    const char *range;
+    int64_t first, last, total;
+    int status;
+    bool ok;
+    int sock = connect_origin(host, port);
+
+    if (sock == -1)
+    {
+      printf("%s:%s - Connect failed\n", host, port);
+      return false;
+    }
+
+    snprintf(header, sizeof(header),
+             "GET %s HTTP/1.1\r\n"
+             "Host: %s\r\n"
+             "Range: bytes=%" PRId64 "-%" PRId64 "\r\n"
+             "Connection: close\r\n"
+             "\r\n", path, host, offset, offset + SEGMENT_SIZE - 1);
+
+    if (!send_all(sock, header, strlen(header)) ||
+        !recv_header(sock, header, sizeof(header)) ||
+        sscanf(header, "HTTP/%*d.%*d %d", &status) != 1)
+    {
+      printf("%s:%s%s - Invalid response\n", host, port, path);
+      close(sock);
+      return false;
+    }
+
+    switch (status)
+    {
+      case 206:
+        range = header_field(header, "Content-Range");
+        if (!range || sscanf(range, " bytes %" SCNd64 "-%" SCNd64 "/%" SCNd64,
+                             &first, &last, &total) != 3 || first != offset)
+        {
+          printf("%s:%s%s - Invalid range\n", host, port, path);
+          close(sock);
+          return false;
+        }
+        ok = copy_response(sock, header, file, 0, last - first + 1);
+        close(sock);
+        if (!ok)
+        {
+          printf("%s:%s%s - Incomplete\n", host, port, path);
+          return false;
+        }
+        offset = last + 1;
+        if (offset < total)
+        {
+          continue;
+        }
+        return true;
+
+      case 200:
+        // No range support, so skip what is already there
+        ok = copy_response(sock, header, file, offset, -1);
+        close(sock);
+        if (!ok)
+        {
+          printf("%s:%s%s - Incomplete\n", host, port, path);
+        }
+        return ok;
+
+      case 416:
+        // Nothing left to download
+        close(sock);
+        return offset > 0;
+
+      default:
+        printf("%s:%s%s - Status %d\n", host, port, path, status);
+        close(sock);
+        return false;
+    }
+  }
+}
+
+// A file from an archive directory, either a plain file or an .a2sz file
+// standing in for an .a2stream file
+struct source
+{
+  int      file;
+  int64_t  size;       // (decompressed) file size
+  uint32_t frames;     // number of .a2sz frames, 0 for a plain file
+  uint8_t *index;      // .a2sz frame index
+  struct
+  {
+    uint32_t num;
+    int64_t  offset;   // offset in decompressed file
+    int64_t  size;
+    uint8_t *data;
+  } frame;             // decompressed frame read from
+};
+
+static uint64_t get_le(const uint8_t *bytes, int size)
+{
+  uint64_t value = 0;
+
+  while (size--)
+  {
+    value = value << 8 | bytes[size];
+  }
+  return value;
+}
+
+// Offset of frame <num> in the decompressed (side 0) or .a2sz (side 8) file
+#define frame_offset(src, num, side) \
+        ((int64_t)get_le((src)->index + (num) * 16 + (side), 8))
+
+static bool open_packed(struct source *src, int file)
+{
+  uint8_t trailer[8];
+  struct stat st;
+  size_t size;
+
+  if (fstat(file, &st) || st.st_size < (off_t)sizeof(trailer) ||
+      pread(file, trailer, sizeof(trailer),
+            st.st_size - sizeof(trailer)) != sizeof(trailer) ||
+      memcmp(trailer + 4, "A2SZ", 4))
+  {
+    return false;
+  }
+  src->frames = (uint32_t)get_le(trailer, 4);
+  size = ((size_t)src->frames + 1) * 16;
+  if (!src->frames || size > (size_t)st.st_size - sizeof(trailer) ||
+      !(src->index = malloc(size)) ||
+      pread(file, src->index, size,
+            st.st_size - sizeof(trailer) - size) != (ssize_t)size)
+  {
+    return false;
+  }
+  src->size = frame_offset(src, src->frames, 0);
+  return true;
+}
+
+static bool open_source(struct source *src, const char *name)
+{
+  char packed[FILENAME_MAX];
+  const char *ext = strrchr(name, '.');
+
+  memset(src, 0, sizeof(*src));
+  src->file = open(name, O_RDONLY);
+  if (src->file != -1)
+  {
+    struct stat st;
+
+    fstat(src->file, &st);
+    src->size = st.st_size;
+    return S_ISREG(st.st_mode);
+  }
+
+  if (!ext || strcasecmp(ext, ".a2stream"))
+  {
+    return false;
+  }
+  snprintf(packed, sizeof(packed), "%.*s.a2sz", (int)(ext - name), name);
+  src->file = open(packed, O_RDONLY);
+  return src->file != -1 && open_packed(src, src->file);
+}
+
+static void close_source(struct source *src)
+{
+  free(src->frame.data);
+  free(src->index);
+  if (src->file != -1)
+  {
+    close(src->file);
+  }
+}
+
+// Decompress the frame containing <offset> unless it's the one read from
+// already. A request reads a frame in several parts, but different requests
+// hardly ever read the same frame, so there's no point in keeping more.
+static bool load_frame(struct source *src, int64_t offset)
+{
+  uint32_t lo = 0, hi = src->frames - 1;
+  uLongf size;
+  uint8_t *packed;
+  int64_t packed_size;
+
+  // Binary search for the last frame starting at or before <offset>
+  while (lo < hi)
+  {
+    uint32_t mid = (lo + hi + 1) / 2;
+    if (frame_offset(src, mid, 0) <= offset)
+    {
+      lo = mid;
+    }
+    else
+    {
+      hi = mid - 1;
+    }
+  }
+
+  if (src->frame.data && src->frame.num == lo)
+  {
+    return true;
+  }
+
+  src->frame.offset = frame_offset(src, lo, 0);
+  src->frame.size = frame_offset(src, lo + 1, 0) - src->frame.offset;
+  packed_size = frame_offset(src, lo + 1, 8) - frame_offset(src, lo, 8);
+  free(src->frame.data);
+  src->frame.data = malloc(src->frame.size);
+  packed = malloc(packed_size);
+  size = src->frame.size;
+  if (!src->frame.data || !packed ||
+      pread(src->file, packed, packed_size,
+            frame_offset(src, lo, 8)) != packed_size ||
+      uncompress(src->frame.data, &size, packed, packed_size) != Z_OK ||
+      (int64_t)size != src->frame.size)
+  {
+    free(src->frame.data);
+    src->frame.data = NULL;
+    free(packed);
+    return false;
+  }
+  free(packed);
+  src->frame.num = lo;
+  return true;
+}
+
+static ssize_t read_source(struct source *src, char *buf, size_t size,
+                           int64_t offset)
+{
+  int64_t skip;
+
+  if (!src->frames)
+  {
+    return pread(src->file, buf, size, offset);
+  }
+
+  if (!load_frame(src, offset))
+  {
+    return -1;
+  }
+  skip = offset - src->frame.offset;
+  if ((int64_t)size > src->frame.size - skip)
+  {
+    size = (size_t)(src->frame.size - skip);
+  }
+  memcpy(buf, src->frame.data + skip, size);
+  return size;
+}
+
+static void serve_archive(int client, const char *dir, const char *path,
+                          const char *range)
+{
+  static const char missing[] = "HTTP/1.0 404 Not Found\r\n"
+                                "Connection: close\r\n"
+                                "\r\n";
+  char header[HEADER_MAX];
+  char name[FILENAME_MAX];
+  char buf[0x4000];
+  struct source src;
+  int64_t first = 0, last = -1;
+
+  snprintf(name, sizeof(name), "%s%s", dir, path);
+  if (strstr(path, "/..") || !open_source(&src, name))
+  {
+    send_all(client, missing, strlen(missing));
+    close_source(&src);
+    return;
+  }
+
+  // Only "bytes=<first>-[<last>]" is supported, anything else is ignored
+  if (!range || sscanf(range, " bytes=%" SCNd64 "-%" SCNd64,
+                       &first, &last) < 1 || first < 0)
+  {
+    range = NULL;
+    first = 0;
+    last = -1;
+  }
+  if (last < 0 || last >= src.size)
+  {
+    last = src.size - 1;
+  }
+  if (range && first > last)
+  {
+    snprintf(header, sizeof(header),
+             "HTTP/1.0 416 Range Not Satisfiable\r\n"
+             "Content-Range: bytes */%" PRId64 "\r\n"
+             "Connection: close\r\n"
+             "\r\n", src.size);
+    send_all(client, header, strlen(header));
+    close_source(&src);
+    return;
+  }
+
+  if (range)
+  {
+    snprintf(header, sizeof(header),
+             "HTTP/1.0 206 Partial Content\r\n"
+             "Content-Type: application/octet-stream\r\n"
+             "Content-Range: bytes %" PRId64 "-%" PRId64 "/%" PRId64 "\r\n"
+             "Content-Length: %" PRId64 "\r\n"
+             "Connection: close\r\n"
+             "\r\n", first, last, src.size, last + 1 - first);
+  }
+  else
+  {
+    snprintf(header, sizeof(header),
+             "HTTP/1.0 200 OK\r\n"
+             "Content-Type: application/octet-stream\r\n"
+             "Accept-Ranges: bytes\r\n"
+             "Content-Length: %" PRId64 "\r\n"
+             "Connection: close\r\n"
+             "\r\n", src.size);
+  }
+
+  if (send_all(client, header, strlen(header)))
+  {
+    while (first <= last)
+    {
+      size_t size = last + 1 - first < (int64_t)sizeof(buf) ?
+                    (size_t)(last + 1 - first) : sizeof(buf);
+      ssize_t n = read_source(&src, buf, size, first);
+      if (n <= 0 || !send_all(client, buf, n))
+      {
+        break;
+      }
+      first += n;
+    }
+  }
+  close_source(&src);
+}
+
+// A2Stream sends a 7-byte record of playback statistics when quitting or
+// after the end of the stream, see player.c. The record is logged with the
+// <file> it belongs to.
+static void log_stats(int client, const char *file)
+{
+  struct pollfd fd = {client, POLLIN, 0};
+  struct timeval timeout = {1, 0};
+  uint8_t stats[7];
+
+  // Have the client see the end of the stream
+  shutdown(client, SHUT_WR);
+
+  if (poll(&fd, 1, STATS_WAIT * 1000) != 1 ||
+      setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) ||
+      recv(client, stats, sizeof(stats), MSG_WAITALL) != sizeof(stats) ||
+      stats[0] != 0xA2 || stats[1] != 0x54)
+  {
+    return;
+  }
+  printf("%s - Underruns %u, waiting %.1fs, seeks %u\n", file,
+         (unsigned)get_le(stats + 2, 2), get_le(stats + 4, 2) / 120.0,
+         stats[6]);
+}
+
+// Only the origin servers given on the command line are allowed. Without
+// them, any origin server on port 80 is allowed.
+static bool origin_allowed(const char *host, const char *port)
+{
+  int i;
+
+  if (!num_origins)
+  {
+    return !strcmp(port, "80");
+  }
+  for (i = 0; i < num_origins; ++i)
+  {
+    const char *c = strchr(origins[i], ':');
+    size_t len = c ? (size_t)(c - origins[i]) : strlen(origins[i]);
+
+    if (strlen(host) == len && !strncasecmp(origins[i], host, len) &&
+        atoi(c ? c + 1 : "80") == atoi(port))
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Start a downloader process unless there's one running already
+static void start_download(int client, const char *name, const char *part,
+                           const char *host, const char *port, const char *path)
+{
+  int file = open(part, O_WRONLY | O_CREAT, 0644);
+
+  if (file == -1)
+  {
+    return;
+  }
+  if (flock(file, LOCK_EX | LOCK_NB))
+  {
+    close(file);
+    return;
+  }
+
+  // Completed meanwhile
+  if (!access(name, F_OK))
+  {
+    unlink(part);
+    close(file);
+    return;
+  }
+
+  if (!fork())
+  {
+    // Don't keep the client connection open
+    close(client);
+
+    printf("%s:%s%s - Downloading\n", host, port, path);
+    if (download(file, host, port, path))
+    {
+      printf("%s:%s%s - Complete\n", host, port, path);
+      rename(part, name);
+    }
+    else if (!lseek(file, 0, SEEK_END))
+    {
+      // Have waiting clients fail instead of retrying
+      unlink(part);
+    }
+    exit(EXIT_SUCCESS);
+  }
+
+  // The downloader process keeps the lock
+  close(file);
+}
+
+static bool download_running(const char *part)
+{
+  int file = open(part, O_RDONLY);
+  bool running;
+
+  if (file == -1)
+  {
+    return false;
+  }
+  running = flock(file, LOCK_SH | LOCK_NB) != 0;
+  close(file);
+  return running;
+}
+
+static void serve(int client)
+{
+  static const char ok[] = "HTTP/1.0 200 OK\r\n"
+                           "Content-Type: application/octet-stream\r\n"
+                           "Connection: close\r\n"
+                           "\r\n";
+  static const char bad[] = "HTTP/1.0 400 Bad Request\r\n"
+                            "Connection: close\r\n"
+                            "\r\n";
+  static const char forbidden[] = "HTTP/1.0 403 Forbidden\r\n"
+                                  "Connection: close\r\n"
+                                  "\r\n";
+  static const char failed[] = "HTTP/1.0 502 Bad Gateway\r\n"
+                               "Connection: close\r\n"
+                               "\r\n";
+  char request[HEADER_MAX];
+  char host[0x100], port[0x10] = "80";
+  char name[FILENAME_MAX], part[FILENAME_MAX + sizeof(".part")];
+  char *path, *c;
+  const char *range;
+  char buf[0x4000];
+  struct stat st;
+  int64_t sent = 0;
+  bool header = false;
+  bool done;
+  int retries = 0;
+  int file;
+
+  // Expect "GET /<host>[:<port>]/<path> HTTP/1.x"
+  if (!recv_header(client, request, sizeof(request)) ||
+      strncmp(request, "GET /", 5) ||
+      !(c = strchr(request + 5, ' ')) ||
+      !(path = strchr(request + 5, '/')) || path > c)
+  {
+    send_all(client, bad, strlen(bad));
+    return;
+  }
+  range = header_field(c, "Range");
+  *c = '\0';
+  if (path - (request + 5) >= (int)sizeof(host))
+  {
+    send_all(client, bad, strlen(bad));
+    return;
+  }
+  memcpy(host, request + 5, path - (request + 5));
+  host[path - (request + 5)] = '\0';
+  c = strchr(host, ':');
+  if (c)
+  {
+    *c = '\0';
+    snprintf(port, sizeof(port), "%s", c + 1);
+  }
+
+  // Port numbers only, no service names
+  if (!*host || !*port || port[strspn(port, "0123456789")])
+  {
+    send_all(client, bad, strlen(bad));
+    return;
+  }
+
+  snprintf(name, sizeof(name), "%s/%s", cache_dir, host);
+  if (!c && *host != '.' && !stat(name, &st) && S_ISDIR(st.st_mode))
+  {
+    serve_archive(client, name, path, range);
+    snprintf(name, sizeof(name), "%s%s", host, path);
+    log_stats(client, name);
+    return;
+  }
+
+  if (!origin_allowed(host, port))
+  {
+    send_all(client, forbidden, strlen(forbidden));
+    return;
+  }
+
+  // Flatten host, port and path into a single file name
+  snprintf(name, sizeof(name) - 5, "%s/%s_%s%s", cache_dir, host, port, path);
+  for (c = name + strlen(cache_dir) + 1; *c; ++c)
+  {
+    if (!strchr("abcdefghijklmnopqrstuvwxyz"
+                "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789.-", *c))
+    {
+      *c = '_';
+    }
+  }
+  snprintf(part, sizeof(part), "%s.part", name);
+
+  file = open(name, O_RDONLY);
+  done = file != -1;
+  if (!done)
+  {
+    start_download(client, name, part, host, port, path);
+    file = open(part, O_RDONLY);
+    if (file == -1)
+    {
+      // Completed meanwhile
+      file = open(name, O_RDONLY);
+      done = file != -1;
+    }
+    if (file == -1)
+    {
+      send_all(client, failed, strlen(failed));
+      return;
+    }
+  }
+
+  while (true)
+  {
+    fstat(file, &st);
+    if (st.st_size > sent)
+    {
+      size_t size = st.st_size - sent < (int64_t)sizeof(buf) ?
+                    (size_t)(st.st_size - sent) : sizeof(buf);
+      ssize_t n = pread(file, buf, size, sent);
+      if (n <= 0 ||
+          (!header && !send_all(client, ok, strlen(ok))) ||
+          !send_all(client, buf, n))
+      {
+        break;
+      }
+      header = true;
+      sent += n;
+      continue;
+    }
+    if (done)
+    {
+      break;
+    }
+
+    // The renamed file is still the one open, so just drain it
+    if (!access(name, F_OK))
+    {
+      done = true;
+      continue;
+    }
+
+    if (!download_running(part))
+    {
+      if (access(part, F_OK) || ++retries > RETRY_MAX)
+      {
+        if (!header)
+        {
+          send_all(client, failed, strlen(failed));
+        }
+        break;
+      }
+      start_download(client, name, part, host, port, path);
+    }
+    usleep(POLL_MSECS * 1000);
+  }
+  close(file);
+
+  snprintf(name, sizeof(name), "%s:%s%s", host, port, path);
+  log_stats(client, name);
+}
+
+int main(int argc, char *argv[])
+{
+  struct addrinfo hints = {.ai_family = AF_INET6, .ai_socktype = SOCK_STREAM,
+                           .ai_flags = AI_PASSIVE};
+  struct addrinfo *addr;
+  const char *port = PROXY_PORT;
+  int server;
+  int on = 1, off = 0;
+
+  if (argc < 2)
+  {
+    printf("Usage: %s <cache dir> [<port> [<origin host>[:<port>]...]]\n",
+           argv[0]);
+    return EXIT_FAILURE;
+  }
+  cache_dir = argv[1];
+  if (argc > 2)
+  {
+    port = argv[2];
+  }
+  if (argc > 3)
+  {
+    origins = argv + 3;
+    num_origins = argc - 3;
+  }
+
+  if (getaddrinfo(NULL, port, &hints, &addr))
+  {
+    printf("Invalid port %s\n", port);
+    return EXIT_FAILURE;
+  }
+  server = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+  if (server == -1 ||
+      setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) ||
+      setsockopt(server, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off)) ||
+      bind(server, addr->ai_addr, addr->ai_addrlen) ||
+      listen(server, SOMAXCONN))
+  {
+    perror("Listening");
+    return EXIT_FAILURE;
+  }
+  freeaddrinfo(addr);
+
+  // Have finished clients and downloaders reaped automatically
+  signal(SIGCHLD, SIG_IGN);
+  setvbuf(stdout, NULL, _IOLBF, 0);
+
+  printf("Serving %s on port %s\n", cache_dir, port);
+  while (true)
+  {
+    int client = accept(server, NULL, NULL);
+
+    if (client == -1)
+    {
+      continue;
+    }
+    if (!fork())
+    {
+      close(server);
+      serve(client);
+      close(client);
+      exit(EXIT_SUCCESS);
+    }
+    close(client);
+  }
+}
@@ -43,6 +43,7 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "w5100.h"
 #include "w5100_http.h"
 #include "player.h"
+#include "ensoniq.h"
 #include "linenoise.h"
 
 #include "a2stream.h"
@@ -171,11 +172,348 @@ bool load_hires(bool page2)
   return true;
 }
 
+static bool skip(uint16_t len)
+{
+  uint16_t recv;
+
+  while (len)
+  {
+    recv = w5100_receive_request();
+    if (!recv)
+    {
+      if (!w5100_connected() || input_check_for_abort_key())
+      {
+        return false;
+      }
+      continue;
+    }
+
+    if (recv > len)
+    {
+      recv = len;
+    }
+    w5100_receive_commit(recv);
+    len -= recv;
+  }
+  return true;
+}
+
+// The cover art cache is a directory with up to COVER_NUM cover files and
+// an index file listing the cover hashes from most to least recently used.
+
+#define COVER_NUM 8
+#define COVER_DIR "covers"
+
+static uint32_t cover_hash[COVER_NUM];
+
+static char *cover_name(char *name, uint32_t hash)
+{
+  sprintf(name, COVER_DIR "/c%08lx", hash);
+  return name;
+}
+
+static bool cache_index(uint32_t hash, bool save)
+{
+  int file;
+  uint8_t i;
+  bool ok;
+
+  file = open(COVER_DIR "/index", O_RDONLY);
+  if (file == -1)
+  {
+    memset(cover_hash, 0, sizeof(cover_hash));
+  }
+  else
+  {
+    read(file, cover_hash, sizeof(cover_hash));
+    close(file);
+  }
+
+  for (i = 0; i < COVER_NUM - 1; ++i)
+  {
+    if (cover_hash[i] == hash)
+    {
+      break;
+    }
+  }
+  ok = cover_hash[i] == hash;
+
+  if (!ok && !save)
+  {
+    return false;
+  }
+
+  // Remove least recently used cover
+  if (!ok && cover_hash[i])
+  {
+    char name[FILENAME_MAX];
+    remove(cover_name(name, cover_hash[i]));
+  }
+
+  // Move cover to front
+  memmove(&cover_hash[1], &cover_hash[0], i * sizeof(cover_hash[0]));
+  cover_hash[0] = hash;
+
+  _filetype = PRODOS_T_BIN;
+  file = open(COVER_DIR "/index", O_WRONLY | O_CREAT | O_TRUNC);
+  _filetype = PRODOS_T_TXT;
+  if (file != -1)
+  {
+    write(file, cover_hash, sizeof(cover_hash));
+    close(file);
+  }
+  return ok;
+}
+
+static bool cache_read(int file, bool page2, uint8_t *buffer)
+{
+  uint8_t *ptr;
+
+  for (ptr = (uint8_t *)0x2000; ptr < (uint8_t *)0x4000; ptr += 0x0800)
+  {
+    if (read(file, buffer, 0x0800) != 0x0800)
+    {
+      return false;
+    }
+
+    if (page2)
+    {
+      page_2();
+    }
+
+    memcpy(ptr, buffer, 0x0800);
+
+    if (page2)
+    {
+      page_1();
+    }
+  }
+  return true;
+}
+
+static bool cache_write(int file, bool page2, uint8_t *buffer)
+{
+  uint8_t *ptr;
+
+  for (ptr = (uint8_t *)0x2000; ptr < (uint8_t *)0x4000; ptr += 0x0800)
+  {
+    if (page2)
+    {
+      page_2();
+    }
+
+    memcpy(buffer, ptr, 0x0800);
+
+    if (page2)
+    {
+      page_1();
+    }
+
+    if (write(file, buffer, 0x0800) != 0x0800)
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool cache_load(uint32_t hash)
+{
+  char name[FILENAME_MAX];
+  uint8_t *buffer;
+  int file;
+  bool ok;
+
+  if (!cache_index(hash, false))
+  {
+    return false;
+  }
+
+  file = open(cover_name(name, hash), O_RDONLY);
+  if (file == -1)
+  {
+    return false;
+  }
+
+  buffer = malloc(0x0800);
+  if (!buffer)
+  {
+    close(file);
+    return false;
+  }
+
+  // Same order as in the stream
+  ok = cache_read(file, true, buffer) && cache_read(file, false, buffer);
+
+  free(buffer);
+  close(file);
+  return ok;
+}
+
+static void cache_save(uint32_t hash)
+{
+  char name[FILENAME_MAX];
+  uint8_t *buffer;
+  int file;
+  bool ok;
+
+  buffer = malloc(0x0800);
+  if (!buffer)
+  {
+    return;
+  }
+
+  _filetype = PRODOS_T_BIN;
+  file = open(cover_name(name, hash), O_WRONLY | O_CREAT | O_TRUNC);
+  _filetype = PRODOS_T_TXT;
+  if (file == -1)
+  {
+    free(buffer);
+    return;
+  }
+
+  ok = cache_write(file, true, buffer) && cache_write(file, false, buffer);
+
+  free(buffer);
+  close(file);
+
+  if (ok)
+  {
+    cache_index(hash, true);
+  }
+  else
+  {
+    remove(name);
+  }
+}
+
+#define BENCH_SECS 15      // duration of each half of the benchmark
+#define BENCH_RATE 22050   // bytes per second required by the player
+#define BENCH_FILL 9       // RX fill levels in 1KB steps plus full
+#define BENCH_HZ   60      // vertical blanks per second (NTSC only)
+
+#define vbl() (*(uint8_t *)0xC019 & 0x80)
+
+// The first half of the benchmark drains the stream at full speed to measure
+// the throughput. The second half drains it at the rate of the player to
+// measure the RX fill levels the player sees.
+static void benchmark(void)
+{
+  // The //e and the IIgs disagree on the polarity of the vertical blank
+  // flag. But they agree on it toggling twice per frame. So counting the
+  // toggles provides a time base independent of the polarity.
+  uint8_t vbl_last = vbl();
+  uint16_t toggles = 0;
+  uint16_t half = BENCH_SECS * BENCH_HZ * 2;
+  uint32_t bytes = 0;
+  uint32_t paced = 0;
+  uint32_t samples = 0;
+  uint32_t fill[BENCH_FILL];
+  uint8_t x = wherex();
+  uint8_t f;
+
+  memset(fill, 0, sizeof(fill));
+
+  while (toggles < half * 2)
+  {
+    uint16_t recv = w5100_receive_request();
+
+    if (vbl() != vbl_last)
+    {
+      vbl_last ^= 0x80;
+      if (!(++toggles % (BENCH_HZ * 2)))
+      {
+        printf("%us", toggles / (BENCH_HZ * 2));
+        gotox(x);
+      }
+
+      // Sample once per toggle, so the RX fill levels are weighted by time
+      if (toggles > half)
+      {
+        ++samples;
+        ++fill[recv >> 10];
+      }
+    }
+
+    if (input_check_for_abort_key())
+    {
+      break;
+    }
+
+    // Commit full pages like the player does. Copying the data in C would
+    // be way slower than the player and therefore limit the measurement.
+    if (recv >= 0x0100)
+    {
+      recv = 0x0100;
+    }
+    else if (w5100_connected())
+    {
+      continue;
+    }
+    else if (!recv)
+    {
+      break;
+    }
+
+    if (toggles < half)
+    {
+      bytes += recv;
+    }
+    else
+    {
+      // Don't get ahead of the player
+      if (paced * (BENCH_HZ * 2) >= (uint32_t)(toggles - half) * BENCH_RATE)
+      {
+        continue;
+      }
+      paced += recv;
+    }
+    w5100_receive_commit(recv);
+  }
+
+  if (toggles > half)
+  {
+    toggles = half;
+  }
+  if (toggles < BENCH_HZ * 2)
+  {
+    printf("- Too short\n\n");
+    return;
+  }
+
+  {
+    uint32_t rate = bytes * (BENCH_HZ * 2) / toggles;
+
+    printf("- %lu bytes in %us\n\n", bytes, toggles / (BENCH_HZ * 2));
+    printf("Throughput: %lu.%luKB/s\n", rate / 1024, rate % 1024 * 10 / 1024);
+    printf("Headroom:   %ld%%\n\n",
+           ((int32_t)rate - BENCH_RATE) * 100 / BENCH_RATE);
+  }
+
+  if (!samples)
+  {
+    return;
+  }
+  printf("At %uB/s:\n", BENCH_RATE);
+  for (f = 0; f < BENCH_FILL - 1; ++f)
+  {
+    printf("RX fill %u-%uKB: %3lu%%\n", f, f + 1, fill[f] * 100 / samples);
+  }
+  printf("RX fill full:  %3lu%%\n", fill[f] * 100 / samples);
+  putchar('\n');
+}
+
 void main(int argc, char *argv[])
 {
   uint8_t eth_init = ETH_INIT_DEFAULT;
   bool do_again = false;
+  bool generated = false;
+  bool bench;
+  bool gen_visu;
+  bool doc;
+  uint8_t rate;
   bool tape_out = false;
+  bool report = false;
   char *url = NULL;
   bool Offload_DNS;
 
@@ -290,6 +628,13 @@ void main(int argc, char *argv[])
 
       linenoiseHistoryAdd(url);
 
+      // Measure network throughput instead of playing
+      bench = match("bench:", url);
+      if (bench)
+      {
+        url += 6;
+      }
+
       printf("\n\nProcessing URL ");
       if (!url_parse(url, !Offload_DNS))
       {
@@ -302,26 +647,9 @@ void main(int argc, char *argv[])
     printf("- Ok\n\nSaving URL ");
     printf("- %s\n\n", linenoiseHistorySave("stream.urls") ? "No" : "Ok");
 
-    if (!do_again)
-    {
-      int file;
-
-      do_again = true;
-      printf("Setting output ");
-      file = open("output.tape", O_RDONLY);
-      if (file != -1)
-      {
-        close(file);
-        tape_out = true;
-      }
-      printf("- %s\n\n", tape_out ? "Tape" : "Speaker");
-
-      gen_player(eth_init, tape_out);
-      printf("\n\n");
-    }
-
     // Copy IP config from IP65 to W5100
     w5100_config();
+    do_again = true;
 
     {
       bool ok;
@@ -352,25 +680,88 @@ void main(int argc, char *argv[])
       }
     }
 
+    if (bench)
+    {
+      printf("- Ok\n\nMeasuring throughput ");
+      benchmark();
+      w5100_disconnect();
+      continue;
+    }
+
+    printf("- Ok\n\n");
+
+    // Generate the player while the W5100 already receives the stream
+    if (!generated)
+    {
+      int file;
+
+      generated = true;
+      printf("Setting output ");
+      file = open("output.tape", O_RDONLY);
+      if (file != -1)
+      {
+        close(file);
+        tape_out = true;
+      }
+      printf("- %s\n\n", tape_out ? "Tape" : "Speaker");
+
+      file = open("send.stats", O_RDONLY);
+      if (file != -1)
+      {
+        close(file);
+        report = true;
+      }
+
+      if (!gen_player(eth_init, tape_out))
+      {
+        printf("- Overlap\n");
+        exit(EXIT_FAILURE);
+      }
+      printf("\n\n");
+    }
+
     hires_on();
 
-    printf("- Ok\n\nLoading cover art ");
+    printf("Loading cover art ");
     {
       uint8_t type[2];
+      uint32_t hash = 0;
       char *error = NULL;
 
       if (!load(type, sizeof(type), false))
       {
         error = "Failed";
       }
-      else if (type[0] != 0xA2 || type[1] != 0x01)
+      else if (type[0] != 0xA2 || (type[1] & 0x1F) != 0x01 &&
+                                  (type[1] & 0x1F) != 0x02 &&
+                                  (type[1] & 0x1F) != 0x03 ||
+                                  (type[1] & RATE_NTSC && type[1] & RATE_PAL))
       {
         error = "Unknown stream type";
       }
+      else if ((type[1] & 0x1F) == 0x03 && !(get_ostype() & APPLE_IIGS))
+      {
+        error = "IIgs required";
+      }
+      else if (type[1] & 0x80 && !load((uint8_t *)&hash, sizeof(hash), false))
+      {
+        error = "Failed";
+      }
+      else if (hash && cache_load(hash))
+      {
+        if (!skip(0x4000))
+        {
+          error = "Failed";
+        }
+      }
       else if (!load_hires(true) || !load_hires(false))
       {
         error = "Failed";
       }
+      else if (hash)
+      {
+        cache_save(hash);
+      }
 
       if (error)
       {
@@ -378,6 +769,15 @@ void main(int argc, char *argv[])
         w5100_disconnect();
         continue;
       }
+
+      // Stream type 2 has template parameters instead of templates
+      gen_visu = (type[1] & 0x1F) == 0x02;
+
+      // Stream type 3 has 8-bit samples for the Ensoniq DOC
+      doc = (type[1] & 0x1F) == 0x03;
+
+      // Pulse rate the samples were resampled to, if any
+      rate = type[1] & (RATE_NTSC | RATE_PAL);
     }
     printf("- Ok\n\n");
 
@@ -411,7 +811,14 @@ void main(int argc, char *argv[])
       cputsxy(31, 23, "\xDA\x5F\x5F\x5F\x5F\x5F\x5F\x5F\x5F"
                           "\x5F\x5F\x5F\x5F\x5F\x5F\x5F\x5F\xDF");
 
-      play();
+      if (doc)
+      {
+        play_doc();
+      }
+      else
+      {
+        play(gen_visu, report, rate);
+      }
 
       // Restore text lines 20 to 24
       for (y = 0; y < 4; ++y)
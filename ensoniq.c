@@ -0,0 +1,345 @@
+/******************************************************************************
+
+Copyright (c) 2022, Oliver Schmidt
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the <organization> nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL OLIVER SCHMIDT BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+******************************************************************************/
+
+#include <conio.h>
+
+#include "w5100.h"
+
+#include "ensoniq.h"
+
+//
+// The IIgs Ensoniq DOC plays 8-bit samples from its own 64kB sound RAM.
+// Oscillators 0 and 1 are paired in swap mode: Each one plays an 8kB buffer
+// and, when reaching its end, halts and starts the other one. So a buffer
+// may be refilled as soon as its oscillator is halted. Samples with the value
+// zero would halt an oscillator too, therefore the server never sends them.
+//
+// The DOC scans 32 oscillators with 894886Hz / (32 + 2) = 26320Hz and each
+// scan advances the buffer pointer by FREQ / 2^(9 + RES - T) samples with T
+// being the table size code. So the sample rate is FREQ * 26320 / 2^(9 + RES
+// - T). With an 8kB buffer (T = 5) and RES = 7, FREQ = 22050 * 2^11 / 26320
+// = 1716 gives 22055Hz, which is close enough to the stream rate.
+//
+// At the end of the stream the rest of the buffer being filled is silenced
+// and the oscillator of the last buffer is switched to one-shot mode while
+// it plays, so it halts at the end of the buffer instead of starting the
+// other one again.
+//
+// The CPU just copies the stream into the sound RAM so it may run at full
+// speed. The sound GLU syncs every access to it with the 1MHz bus anyway.
+//
+
+#define DOC_RATE  22050L  // samples per second
+#define DOC_FREQ  1716    // oscillator frequency for DOC_RATE, see above
+#define DOC_OSCS  32      // number of enabled oscillators
+#define DOC_TABLE 0x2F    // table size 8kB (5 << 3), resolution 7
+#define BUF_PAGES 0x20    // pages per sound RAM buffer
+
+#define SOUND_CTL  0xC03C  // sound GLU control
+#define SOUND_DATA 0xC03D  // sound GLU data
+#define SOUND_LO   0xC03E  // sound GLU address low byte
+#define SOUND_HI   0xC03F  // sound GLU address high byte
+
+#define CTL_BUSY 0x80  // access to DOC in progress
+#define CTL_RAM  0x40  // access sound RAM instead of DOC registers
+#define CTL_INC  0x20  // auto-increment address
+#define CTL_VOL  0x0F  // system volume
+
+#define DOC_FREQ_LO 0x00  // oscillator frequency low byte
+#define DOC_FREQ_HI 0x20  // oscillator frequency high byte
+#define DOC_VOLUME  0x40  // oscillator volume
+#define DOC_POINTER 0x80  // oscillator buffer address high byte
+#define DOC_CONTROL 0xA0  // oscillator control
+#define DOC_SIZE    0xC0  // oscillator table size and resolution
+#define DOC_ENABLE  0xE1  // number of enabled oscillators
+
+#define DOC_HALT 0x01  // oscillator halted
+#define DOC_ONCE 0x02  // oscillator in one-shot mode
+#define DOC_SWAP 0x06  // oscillator in swap mode
+
+#define sound(reg) (*(volatile uint8_t *)(reg))
+
+#define LO(addr)  ((uint8_t)((uint16_t)(addr)   ))
+#define HI(addr)  ((uint8_t)((uint16_t)(addr)>>8))
+
+#define mix_off() (*(uint8_t *)0xC052 = 0)
+#define mix_on()  (*(uint8_t *)0xC053 = 0)
+
+static uint8_t volume;
+
+static void doc_select(uint8_t ctl, uint8_t reg)
+{
+  while (sound(SOUND_CTL) & CTL_BUSY)
+    ;
+  sound(SOUND_CTL) = ctl | volume;
+  sound(SOUND_LO)  = reg;
+}
+
+static void doc_write(uint8_t reg, uint8_t val)
+{
+  doc_select(0, reg);
+  sound(SOUND_DATA) = val;
+}
+
+static uint8_t doc_read(uint8_t reg)
+{
+  doc_select(0, reg);
+
+  // The first read just latches the register
+  sound(SOUND_DATA);
+  return sound(SOUND_DATA);
+}
+
+static void doc_halt(void)
+{
+  doc_write(DOC_CONTROL + 0, DOC_SWAP | DOC_HALT);
+  doc_write(DOC_CONTROL + 1, DOC_SWAP | DOC_HALT);
+}
+
+static void copy_page(uint8_t page)
+{
+  register uint8_t i = 0;
+  register volatile uint8_t *data = w5100_data;
+
+  doc_select(CTL_RAM | CTL_INC, 0x00);
+  sound(SOUND_HI) = page;
+
+  // Only - actual - register (aka zero page) variables here !!!
+  do
+  {
+    sound(SOUND_DATA) = *data;
+  }
+  while (--i);
+
+  w5100_receive_commit(0x0100);
+}
+
+// Fill the rest of buffer <buf> starting with page <page> with silence
+static void silence(uint8_t buf, uint8_t page)
+{
+  uint16_t i = (BUF_PAGES - page) << 8;
+
+  doc_select(CTL_RAM | CTL_INC, 0x00);
+  sound(SOUND_HI) = buf * BUF_PAGES + page;
+  do
+  {
+    sound(SOUND_DATA) = 0x80;
+  }
+  while (--i);
+}
+
+enum state {waiting, loading, pausing, playing, draining};
+
+static char display[][5] = {"Wait", "Load", "Paus"};
+
+void play_doc(void)
+{
+  uint8_t cya;
+  uint8_t osc;
+  uint8_t ctl[2];
+  uint16_t skip;
+  uint8_t buf = 0;        // buffer to be filled next
+  uint8_t page = 0;       // page of that buffer to be filled next
+  bool ready = false;     // oscillator of that buffer halted after playing it
+  enum state state = waiting;
+  enum state paused;
+  uint8_t last;           // last buffer to play at the end of the stream
+  bool once;              // oscillator of that buffer set to one-shot mode
+
+  volume = sound(SOUND_CTL) & CTL_VOL;
+
+  cya = *(uint8_t *)0xC036;
+  *(uint8_t *)0xC036 |= 0b10000000; // set fast speed
+
+  doc_write(DOC_ENABLE, (DOC_OSCS - 1) * 2);
+  for (osc = 0; osc < DOC_OSCS; ++osc)
+  {
+    doc_write(DOC_CONTROL + osc, DOC_HALT);
+  }
+  for (osc = 0; osc < 2; ++osc)
+  {
+    doc_write(DOC_CONTROL + osc, DOC_SWAP | DOC_HALT);
+    doc_write(DOC_FREQ_LO + osc, LO(DOC_FREQ));
+    doc_write(DOC_FREQ_HI + osc, HI(DOC_FREQ));
+    doc_write(DOC_VOLUME  + osc, 0xFF);
+    doc_write(DOC_POINTER + osc, osc * BUF_PAGES);
+    doc_write(DOC_SIZE    + osc, DOC_TABLE);
+  }
+
+  while (true)
+  {
+    bool open = w5100_connected();
+    uint16_t recv;
+
+    if (kbhit())
+    {
+      char c = cgetc();
+      if (c == CH_ESC)
+      {
+        w5100_disconnect();
+        break;
+      }
+      if (c >= '1' && c <= '9')
+      {
+        if (state != loading)
+        {
+          doc_halt();
+          buf = page = 0;
+          state = loading;
+          // Both buffers are refilled after the target page
+          skip = ((c - '0') * 60 * DOC_RATE + 0x80) / 0x0100;
+        }
+      }
+      else if (state == pausing)
+      {
+        if (paused == playing || paused == draining)
+        {
+          doc_write(DOC_CONTROL + 0, ctl[0]);
+          doc_write(DOC_CONTROL + 1, ctl[1]);
+          state = paused;
+        }
+        else
+        {
+          state = waiting;
+        }
+      }
+      else
+      {
+        ctl[0] = doc_read(DOC_CONTROL + 0);
+        ctl[1] = doc_read(DOC_CONTROL + 1);
+        doc_halt();
+        paused = state;
+        state = pausing;
+      }
+    }
+    if (state == loading)
+    {
+      uint8_t pages = w5100_receive_request() >> 8;
+      if (pages)
+      {
+        // Don't skip beyond the target page
+        if (pages > skip)
+        {
+          pages = skip;
+        }
+        w5100_receive_commit(pages << 8);
+        skip -= pages;
+        if (!skip)
+        {
+          state = waiting;
+        }
+      }
+      else if (!open)
+      {
+        break;
+      }
+    }
+    else if (state == draining)
+    {
+      bool halted = doc_read(DOC_CONTROL + last) & DOC_HALT;
+      if (!once && !halted)
+      {
+        doc_write(DOC_CONTROL + last, DOC_ONCE);
+        once = true;
+      }
+      else if (once && halted)
+      {
+        break;
+      }
+    }
+    else if (state != pausing)
+    {
+      if (state == playing)
+      {
+        if (doc_read(DOC_CONTROL + buf) & DOC_HALT)
+        {
+          ready = true;
+        }
+        else if (ready)
+        {
+          // The other oscillator restarted this buffer before it was
+          // refilled. So halt both and refill both before restarting.
+          doc_halt();
+          buf = page = 0;
+          state = waiting;
+        }
+      }
+      recv = w5100_receive_request();
+      if ((state == waiting || ready) && recv >= 0x0100)
+      {
+        copy_page(buf * BUF_PAGES + page);
+        if (++page == BUF_PAGES)
+        {
+          page = 0;
+          buf ^= 1;
+          ready = false;
+
+          // Start playing as soon as both buffers are filled
+          if (state == waiting && !buf)
+          {
+            doc_write(DOC_CONTROL + 0, DOC_SWAP);
+            state = playing;
+          }
+        }
+      }
+      else if (!open && recv < 0x0100)
+      {
+        // Play what's left in the buffers
+        last = buf ^ 1;
+        if (page)
+        {
+          silence(buf, page);
+          last = buf;
+        }
+        if (state == waiting)
+        {
+          if (!page && !buf)
+          {
+            break;
+          }
+          doc_write(DOC_CONTROL + 0, last ? DOC_SWAP : DOC_ONCE);
+        }
+        once = false;
+        state = draining;
+      }
+    }
+    if (state == playing || state == draining)
+    {
+      mix_off();
+    }
+    else
+    {
+      mix_on();
+      cputsxy(35, 22, display[state]);
+    }
+  }
+
+  doc_halt();
+  *(uint8_t *)0xC036 = cya;
+}
@@ -29,8 +29,10 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #define _CRT_NONSTDC_NO_WARNINGS
 #define _CRT_SECURE_NO_WARNINGS
+#define _USE_MATH_DEFINES
 #ifdef _WIN32
 #include <io.h>
+#include <process.h>
 #else
 #include <unistd.h>
 #define O_BINARY 0
@@ -39,15 +41,31 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <math.h>
 #include <string.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <inttypes.h>
 #include <sys/stat.h>
+#ifdef __linux__
+#include <time.h>
+#include <poll.h>
+#include <errno.h>
+#include <dirent.h>
+#include <strings.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/inotify.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <zlib.h>
+#endif
 
 //
 // The .RAW audio data input file has be header-less, mono (!) and has to
-// consist of 32-bit float values at a sample frequency of 22050 Hz.
+// consist of 32-bit float values (or 16-bit signed values with option -s)
+// at a sample frequency of 22050 Hz.
 //
 // Such a file can be easily created with Audacity by:
 // 1. Project Rate (lower left corner): 22050
@@ -55,14 +73,18 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 // 3. File | Export | Export Audio...
 //      Save as type: Other uncompressed files
 //      Header: RAW (header-less)
-//      Encoding: 32-bit float
+//      Encoding: 32-bit float (or Signed 16-bit PCM)
 //
 
 //
 // The .A2Stream output file consists of four parts:
 //
 // 1. A 2-byte stream type header. The first byte is 0xA2, the second byte is
-//    currently 0x01.
+//    0x01 or - with option -c - 0x02 or - with option -g - 0x03. With option
+//    -n, bit 5 of the second byte is set and with option -e, bit 6 is set, so
+//    the player knows the pulse rate the audio was resampled to. With option
+//    -k, bit 7 of the second byte is set and the header is followed by a
+//    4-byte hash of the cover, which allows the player to cache the cover.
 // 
 // 2. A 16 kB Apple II DHGR graphics screen. This part is copied from the .DHGR
 //    cover art input file. The bottom 6 lines of the screen are set to black.
@@ -73,6 +95,9 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 //    - The following 39 bytes represent a line of a 40 byte DHGR graphics
 //      screen with the rightmost byte missing. That line is displayed in the
 //      bottom 6 lines of the screen.
+//    With stream type 0x02 there are instead 8 bytes of parameters, which
+//    the player uses to generate the templates itself, see write_param().
+//    With stream type 0x03 this part is missing.
 //
 // 4. A variable number of sample data chunks. Each chunk consists of 256 bytes
 //    with 255 audio samples and one visualization byte.
@@ -85,6 +110,28 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 //      However, those 36 values are all added to a bias. That bias is 100 for
 //      samples at offset 169 to 250 in the data chunk and 64 for samples at
 //      all other offsets.
+//    With stream type 0x03 there are only 8-bit unsigned audio samples
+//    between 1 and 255 for the IIgs Ensoniq DOC, see quantize_doc(). They
+//    are padded with silence to a multiple of 256 bytes.
+//
+// With option -z (Linux only) the .A2Stream file is stored as .A2SZ file
+// instead. It's several times smaller but still allows a server to deliver
+// any part of the .A2Stream file by decompressing only the frames covering
+// that part, see a2proxy.c. The .A2SZ file consists of three parts:
+//
+// 1. The 4-byte signature "A2SZ".
+//
+// 2. A variable number of frames. Each frame is a zlib stream of a part of the
+//    .A2Stream file that can be decompressed on its own. The first frame holds
+//    parts 1 to 3 of the .A2Stream file, every other frame holds 256 sample
+//    data chunks (about 3 seconds), except for the last one.
+//
+// 3. A frame index with one entry per frame and a final entry for the end of
+//    the files. Each entry consists of the 64-bit offset in the .A2Stream file
+//    and the 64-bit offset in the .A2SZ file. The index is followed by the
+//    32-bit number of frames and again the signature.
+//
+//    All numbers are little-endian.
 //
 
 //
@@ -114,8 +161,15 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #define STREAM_TYPE_MAJOR 0xA2
 #define STREAM_TYPE_MINOR 0x01
+#define STREAM_TYPE_PARAM 0x02
+#define STREAM_TYPE_DOC   0x03
+#define STREAM_TYPE_NTSC  0x20
+#define STREAM_TYPE_PAL   0x40
+#define STREAM_TYPE_CACHE 0x80
+#define STREAM_TYPE_FLAGS (STREAM_TYPE_NTSC | STREAM_TYPE_PAL | STREAM_TYPE_CACHE)
 
 #define SAMPLE_MAX_VAL 0x23
+#define DOC_MAX_VAL    0xFF
 #define SAMPLE_LO_BASE 0x40
 #define SAMPLE_HI_BASE 0x64
 #define SAMPLE_LO_2_HI 0xA9
@@ -142,8 +196,6 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 extern uint8_t dhgr[0x4000];
 
-const uint8_t type[2] = {STREAM_TYPE_MAJOR, STREAM_TYPE_MINOR};
-
 const int lines[12] = {0x0BD0, 0x0FD0, 0x13D0, 0x17D0, 0x1BD0, 0x1FD0,
                        0x2BD0, 0x2FD0, 0x33D0, 0x37D0, 0x3BD0, 0x3FD0};
 
@@ -251,191 +303,469 @@ void write_progress_bar(int a2str)
   #undef MAX
 }
 
-int main(int argc, const char *argv[])
+// 32-bit FNV-1a hash of the cover, but never 0 as that means 'no cover'
+uint32_t cover_hash(void)
 {
-  if (argc < 2 || argc == 3 && argv[1][0] != '-' || argc > 3)
+  uint32_t hash = 0x811C9DC5;
+  for (int i = 0; i < sizeof(dhgr); i++)
   {
-    fprintf(stderr,
-            "usage: %s [option] audio\n"
-            "       option -v: show level meter (default)\n"
-            "              -p: show progress bar\n"
-            "       audio: headerless 32-bit float 22050Hz mono samples\n",
-            argv[0]);
-    return EXIT_FAILURE;
+    hash ^= dhgr[i];
+    hash *= 0x01000193;
   }
+  return hash ? hash : 1;
+}
 
-  enum visual visual = level_meter;
-  if (argc > 2 && argv[1][1] == 'p')
-  {
-    visual = progress_bar;
-  }
-  fprintf(stderr, "\nvisual: %s\n\n", visual == level_meter ? "level meter"
-                                                            : "progress bar");
+// The A2Stream player generates the same templates from these parameters
+bool write_param(int a2str, enum visual visual)
+{
+  #define LEN (PIXEL_MID_POS - PIXEL_MIN_POS)
 
-  int audio = open(argv[argc - 1], O_RDONLY | O_BINARY);
-  fprintf(stderr, "audio: %s\n", argv[argc - 1]);
-  if (audio == -1)
+  uint8_t param[8];
+  if (visual == level_meter)
   {
-    perror("audio");
-    return EXIT_FAILURE;
+    param[0] = level_meter;
+    param[1] = PIXEL_MID_POS;
+    param[2] = LEN;
+    param[3] = PIXEL_GREEN;
+    param[4] = PIXEL_YELLOW;
+    param[5] = PIXEL_ORANGE;
+    param[6] = LEN - 30;
+    param[7] = LEN - 15;
   }
-
-  char *dot = strrchr(argv[argc - 1], '.');
-  if (dot)
+  else
   {
-    *dot = '\0';
+    param[0] = progress_bar;
+    param[1] = PIXEL_MID_POS - VISUAL_NUM_VAL / 4;
+    param[2] = VISUAL_NUM_VAL / 2;
+    param[3] = PIXEL_WHITE;
+    param[4] = PIXEL_GREY;
+    param[5] = PIXEL_WHITE;
+    param[6] = 0;
+    param[7] = 0;
   }
-  char name[256];
 
-  sprintf(name, "%s.dhgr", argv[argc - 1]);
-  int cover = open(name, O_RDONLY | O_BINARY);
-  fprintf(stderr, "cover: %s\n", name);
+  #undef LEN
 
-  sprintf(name, "%s.a2stream", argv[argc - 1]);
-  int a2str = open(name, O_WRONLY | O_BINARY | O_CREAT | O_TRUNC,
-                         S_IREAD | S_IWRITE);
-  fprintf(stderr, "a2str: %s\n\n", name);
-  if (a2str == -1)
+  if (write(a2str, param, sizeof(param)) != sizeof(param))
   {
     perror("a2str");
-    return EXIT_FAILURE;
+    return false;
   }
+  return true;
+}
 
-  if (write(a2str, type, sizeof(type)) != sizeof(type))
-  {
-    perror("a2str");
-    return EXIT_FAILURE;
-  }
+//
+// The Apple II player emits one pulse every CYC_MAX cycles of the Apple II
+// clock. So the actual pulse rate depends on the machine and isn't exactly
+// 22050 Hz. Therefore the audio data may be resampled from 22050 Hz to the
+// actual pulse rate of a machine profile. Otherwise the stream plays 0.6%
+// too fast (and sharp) on an NTSC machine.
+//
+// The resampler is a polyphase FIR filter. For every output sample the
+// filter phase closest to the fractional input position is used. The inner
+// loop has a fixed length to allow the compiler to vectorize it.
+//
 
-  if (cover == -1)
+#define AUDIO_RATE 22050
+#define CYC_MAX    46
+
+struct machine
+{
+  const char *name;
+  double      clock;  // average CPU clock in Hz (incl. stretched cycles)
+  uint8_t     type;   // stream type flag
+};
+
+const struct machine machines[] = {
+  {"none",     AUDIO_RATE * CYC_MAX,  0x00},             // no resampling
+  {"NTSC",     14318180.0 * 65 / 912, STREAM_TYPE_NTSC}, // //e and IIgs (at normal speed)
+  {"PAL",      14250000.0 * 65 / 912, STREAM_TYPE_PAL}   // European //e
+};
+
+struct options
+{
+  enum visual           visual;
+  const struct machine *machine;
+  bool                  pcm16;    // 16-bit signed samples
+  bool                  compact;  // visualization parameters instead of templates
+  bool                  cache;    // cover hash to allow for caching the cover
+  bool                  doc;      // 8-bit samples for the IIgs Ensoniq DOC
+  bool                  packed;   // compressed frames with a frame index
+};
+
+#define RESAMPLE_TAPS   32
+#define RESAMPLE_PHASES 256
+#define RESAMPLE_BUF    4096
+#define AUDIO_BUF       0x10000
+
+struct audio
+{
+  int      file;
+  bool     pcm16;   // 16-bit signed samples instead of 32-bit float samples
+  double   rate;    // output sample rate
+  uint64_t step;    // input samples per output sample (32.32 fixed point)
+  uint64_t time;    // input position of next output sample (32.32 fixed point)
+  int64_t  base;    // input position of buf[0]
+  int64_t  total;   // number of input samples, -1 until end of file
+  int      len;     // number of samples in buf
+  float    buf[RESAMPLE_BUF];
+  float    filter[RESAMPLE_PHASES + 1][RESAMPLE_TAPS];
+  int      in_pos;  // position of next byte in in
+  int      in_len;  // number of bytes in in
+  uint8_t  in[AUDIO_BUF];
+};
+
+void init_audio(struct audio *audio, int file, bool pcm16,
+                const struct machine *machine)
+{
+  audio->file  = file;
+  audio->pcm16 = pcm16;
+  audio->rate = machine->clock / CYC_MAX;
+  audio->step = (uint64_t)((double)AUDIO_RATE / audio->rate * 4294967296.0 + 0.5);
+
+  // Cut off below the lower of the two Nyquist frequencies
+  double cutoff = 0.95 * (audio->rate < AUDIO_RATE ? audio->rate / AUDIO_RATE
+                                                   : 1.0);
+
+  for (int phase = 0; phase <= RESAMPLE_PHASES; phase++)
   {
-    fprintf(stderr, "cover not found: using default\n\n");
+    double sum = 0.0;
+    for (int tap = 0; tap < RESAMPLE_TAPS; tap++)
+    {
+      // Distance between input sample and output sample
+      double d = tap - (RESAMPLE_TAPS / 2 - 1) - (double)phase / RESAMPLE_PHASES;
+      double x = M_PI * cutoff * d;
+      double w = M_PI * d / (RESAMPLE_TAPS / 2);
+
+      // Blackman windowed sinc
+      double h = (x == 0.0 ? 1.0 : sin(x) / x) *
+                 (fabs(d) >= RESAMPLE_TAPS / 2 ? 0.0
+                                               : 0.42 + 0.5 * cos(w) + 0.08 * cos(2 * w));
+      audio->filter[phase][tap] = (float)h;
+      sum += h;
+    }
+    for (int tap = 0; tap < RESAMPLE_TAPS; tap++)
+    {
+      audio->filter[phase][tap] /= (float)sum;  // unity gain at DC
+    }
   }
-  else
+}
+
+int rewind_audio(struct audio *audio)
+{
+  audio->time  = 0;
+  audio->base  = -(RESAMPLE_TAPS / 2 - 1);
+  audio->total = -1;
+  audio->len   = RESAMPLE_TAPS / 2 - 1;
+  memset(audio->buf, 0, sizeof(audio->buf));
+  audio->in_pos = 0;
+  audio->in_len = 0;
+
+  return lseek(audio->file, 0, SEEK_SET) == -1 ? -1 : 0;
+}
+
+bool resampling(const struct audio *audio)
+{
+  return audio->step != (uint64_t)1 << 32;
+}
+
+// Read up to <size> bytes from the audio file, less only at the end of file.
+// The file is read in large blocks as a read() per chunk of samples would take
+// more time than encoding the chunk.
+int read_bytes(struct audio *audio, void *data, int size)
+{
+  int len = 0;
+  while (len < size)
   {
-    if (read(cover, dhgr, sizeof(dhgr)) != sizeof(dhgr))
+    if (audio->in_pos == audio->in_len)
     {
-      perror("cover");
-      return EXIT_FAILURE;
+      int in_len = read(audio->file, audio->in, sizeof(audio->in));
+      if (in_len == -1)
+      {
+        return -1;
+      }
+      if (in_len == 0)
+      {
+        break;
+      }
+      audio->in_pos = 0;
+      audio->in_len = in_len;
     }
 
-    for (int i = 0; i < sizeof(lines) / sizeof(lines[0]); i++)
+    int copy = audio->in_len - audio->in_pos;
+    if (copy > size - len)
     {
-      memset(dhgr + lines[i], PIXEL_BLACK, 40);
+      copy = size - len;
     }
+    memcpy((uint8_t *)data + len, audio->in + audio->in_pos, copy);
+    audio->in_pos += copy;
+    len += copy;
   }
+  return len;
+}
 
-  if (write(a2str, dhgr, sizeof(dhgr)) != sizeof(dhgr))
+// Read up to <size> samples from the audio file as floats
+int read_float(struct audio *audio, float *x, int size)
+{
+  if (!audio->pcm16)
   {
-    perror("a2str");
-    return EXIT_FAILURE;
+    int len = read_bytes(audio, x, size * sizeof(float));
+    return len == -1 ? -1 : len / (int)sizeof(float);
   }
 
-  if (visual == level_meter)
+  int16_t in[RESAMPLE_BUF];
+  int len = read_bytes(audio, in, (size < RESAMPLE_BUF ? size : RESAMPLE_BUF)
+                                  * sizeof(int16_t));
+  if (len == -1)
   {
-      write_level_meter(a2str);
+    return -1;
   }
-  if (visual == progress_bar)
+  len /= sizeof(int16_t);
+  for (int i = 0; i < len; i++)
   {
-      write_progress_bar(a2str);
+    x[i] = in[i] / 32768.0f;
   }
+  return len;
+}
 
-  uint8_t sample_base[SAMPLE_CHUNK_SIZE];
-  for (int i = 0; i < SAMPLE_CHUNK_SIZE; i++)
+// Read up to <size> samples resampled to the machine pulse rate as floats
+int read_audio(struct audio *audio, float *x, int size)
+{
+  if (!resampling(audio))
   {
-    sample_base[i] = i <  SAMPLE_LO_2_HI ||
-                     i >= SAMPLE_HI_2_LO ? SAMPLE_LO_BASE
-                                         : SAMPLE_HI_BASE;
+    return read_float(audio, x, size);
   }
 
-  uint8_t visual_base[VISUAL_NUM_VAL];
-  for (int i = 0; i < VISUAL_NUM_VAL; i++)
+  int count = 0;
+  while (count < size)
   {
-    visual_base[i] = i < VISUAL_LO_2_HI ? VISUAL_LO_BASE + i
-                                        : VISUAL_HI_BASE + i - VISUAL_LO_2_HI;
+    int64_t pos = audio->time >> 32;
+    if (audio->total != -1 && pos >= audio->total)
+    {
+      break;
+    }
+
+    // Filter taps cover input samples pos - TAPS/2 + 1 to pos + TAPS/2
+    int first = (int)(pos - (RESAMPLE_TAPS / 2 - 1) - audio->base);
+    if (first + RESAMPLE_TAPS > audio->len)
+    {
+      audio->len -= first;
+      audio->base += first;
+      memmove(audio->buf, audio->buf + first, audio->len * sizeof(float));
+      first = 0;
+
+      if (audio->total == -1)
+      {
+        int len = read_float(audio, audio->buf + audio->len,
+                             RESAMPLE_BUF - audio->len);
+        if (len == -1)
+        {
+          return -1;
+        }
+        if (len == 0)
+        {
+          audio->total = audio->base + audio->len;
+        }
+        audio->len += len;
+      }
+      if (audio->total != -1)
+      {
+        // Pad with silence beyond the end of file
+        memset(audio->buf + audio->len, 0,
+               (RESAMPLE_BUF - audio->len) * sizeof(float));
+        audio->len = RESAMPLE_BUF;
+      }
+      continue;
+    }
+
+    uint32_t frac = (uint32_t)audio->time;
+    const float *h = audio->filter[((uint64_t)frac + (1u << 23)) >> 24];
+    const float *in = audio->buf + first;
+    float sum = 0.0;
+    for (int tap = 0; tap < RESAMPLE_TAPS; tap++)
+    {
+      sum += in[tap] * h[tap];
+    }
+    x[count++] = sum;
+    audio->time += audio->step;
   }
+  return count;
+}
 
-  uint64_t sample_size = 0;
-  float sample_min = 0.0;
-  float sample_max = 0.0;
+//
+// For 16-bit samples without resampling, the conversion of a sample to a
+// pulse width only depends on the sample value. So it is done via a table
+// lookup instead of float math per sample.
+//
 
-  while (true)
-  {
-    static_assert(sizeof(float) == 4, "float isn't 32-bit");
+bool use_lut(const struct audio *audio)
+{
+  return audio->pcm16 && !resampling(audio);
+}
 
-    float x[SAMPLE_CHUNK_SIZE];
-    int sample = read(audio, x, SAMPLE_CHUNK_SIZE * sizeof(float));
+// Read a chunk of samples padded with silence, either as floats or - if
+// use_lut() - as 16-bit samples. Return the number of samples actually read.
+int read_chunk(struct audio *audio, float *x, int16_t *xi)
+{
+  int sample;
+  if (use_lut(audio))
+  {
+    sample = read_bytes(audio, xi, SAMPLE_CHUNK_SIZE * sizeof(int16_t));
     if (sample == -1)
     {
-      perror("audio");
-      return EXIT_FAILURE;
+      return -1;
     }
-
-    if (sample == 0)
+    sample /= sizeof(int16_t);
+    for (int i = sample; i < SAMPLE_CHUNK_SIZE; i++)
     {
-      break;
+      xi[i] = 0;
     }
-
-    sample /= sizeof(float);
-    while (sample < SAMPLE_CHUNK_SIZE)
+  }
+  else
+  {
+    sample = read_audio(audio, x, SAMPLE_CHUNK_SIZE);
+    if (sample == -1)
     {
-      x[sample++] = 0.0;
+      return -1;
     }
-
-    for (sample = 0; sample < SAMPLE_CHUNK_SIZE; sample++)
+    for (int i = sample; i < SAMPLE_CHUNK_SIZE; i++)
     {
-      if (x[sample] < sample_min)
-      {
-        sample_min = x[sample];
-      }
-      else if (x[sample] > sample_max)
-      {
-        sample_max = x[sample];
-      }
+      x[i] = 0.0;
     }
+  }
+  return sample;
+}
 
-    sample_size += SAMPLE_CHUNK_SIZE;
+int32_t quantize(float x, float sample_min, float sample_max)
+{
+  int32_t sample_val = (int32_t)((x          - sample_min) /
+                                 (sample_max - sample_min) * SAMPLE_MAX_VAL);
 
-    uint32_t h = (uint32_t)(sample_size / 22050 / 3600);
-    uint32_t m = (uint32_t)(sample_size / 22050 /   60 % 60);
-    uint32_t s = (uint32_t)(sample_size / 22050        % 60);
-    fprintf(stderr, "evaluating: %02" PRIu32 ":%02" PRIu32 ":%02" PRIu32 "\r", h, m, s);
+  if (sample_val < 0)
+  {
+    sample_val = 0;
+  }
+  else if (sample_val > SAMPLE_MAX_VAL)
+  {
+    sample_val = SAMPLE_MAX_VAL;
   }
+  return sample_val;
+}
 
-  fprintf(stderr, "\n");
+// The Ensoniq DOC takes 8-bit unsigned samples with 0x80 being the center.
+// A sample value of 0x00 stops the oscillator, so it's never generated.
+uint8_t quantize_doc(float x, float sample_min, float sample_max)
+{
+  int32_t sample_val = (int32_t)((x          - sample_min) /
+                                 (sample_max - sample_min) * (DOC_MAX_VAL - 1) + 1.5f);
 
-  if (lseek(audio, 0, SEEK_SET) == -1)
+  if (sample_val < 1)
   {
-    perror("audio");
-    return EXIT_FAILURE;
+    sample_val = 1;
   }
+  else if (sample_val > DOC_MAX_VAL)
+  {
+    sample_val = DOC_MAX_VAL;
+  }
+  return (uint8_t)sample_val;
+}
 
-  // Only amplify, never quiten - even if that means clipping!
-  if (sample_min < -1.0)
+// Sample data chunks are written to the .a2stream file in large blocks, a
+// write() per chunk would take more time than encoding the chunk.
+struct chunks
+{
+  int     file;
+  int     len;    // number of bytes in buf
+  uint8_t buf[AUDIO_BUF];
+};
+
+bool flush_chunks(struct chunks *chunks)
+{
+  int len = chunks->len;
+  chunks->len = 0;
+  return write(chunks->file, chunks->buf, len) == len;
+}
+
+bool write_chunks(struct chunks *chunks, const void *data, int size)
+{
+  if (chunks->len + size > (int)sizeof(chunks->buf) && !flush_chunks(chunks))
   {
-    sample_min = -1.0;
+    return false;
   }
-  if (sample_max > 1.0)
+  memcpy(chunks->buf + chunks->len, data, size);
+  chunks->len += size;
+  return true;
+}
+
+bool verbose = true;
+
+#ifdef __linux__
+void report_progress(const char *stage, uint64_t seconds);
+#endif
+
+// Only show progress once per second of audio, printing it for every chunk
+// would take more time than encoding the chunk
+void show_progress(const char *stage, uint64_t samples, double rate)
+{
+  static const char *last_stage;
+  static uint64_t last_t;
+  uint64_t t = (uint64_t)(samples / rate);
+
+  if (stage == last_stage && t == last_t)
   {
-    sample_max = 1.0;
+    return;
   }
+  last_stage = stage;
+  last_t = t;
 
-  uint64_t offset = 0;
-  float visual_max = 0.0;
-  int visual_val = -1;
-  int visual_level = 0;
+#ifdef __linux__
+  report_progress(stage, t);
+#endif
 
-  uint64_t val_dist[SAMPLE_MAX_VAL + 1];
-  memset(val_dist, 0, sizeof(val_dist));
+  if (verbose)
+  {
+    uint32_t h = (uint32_t)(t / 3600);
+    uint32_t m = (uint32_t)(t /   60 % 60);
+    uint32_t s = (uint32_t)(t        % 60);
+    fprintf(stderr, "%s: %02" PRIu32 ":%02" PRIu32 ":%02" PRIu32 "\r", stage, h, m, s);
+  }
+}
+
+struct level
+{
+  uint64_t samples;   // number of samples including the padding of the last chunk
+  float    min;       // sample peaks
+  float    max;
+  int16_t  min_i;     // sample peaks if use_lut()
+  int16_t  max_i;
+  float    pct;       // 99.9th percentile of the sample magnitude
+  float    rms;       // root mean square of the samples
+};
+
+// Determine the level of the audio in a single pass. The percentile and the
+// root mean square are only determined with <detail>.
+int evaluate(struct audio *audio, struct level *level, bool detail)
+{
+  static uint32_t hist[0x8001];
+  double square_sum = 0.0;
+  uint64_t count = 0;
+
+  memset(level, 0, sizeof(*level));
+  if (detail)
+  {
+    memset(hist, 0, sizeof(hist));
+  }
 
   while (true)
   {
+    static_assert(sizeof(float) == 4, "float isn't 32-bit");
+
     float x[SAMPLE_CHUNK_SIZE];
-    int sample = read(audio, x, SAMPLE_CHUNK_SIZE * sizeof(float));
+    int16_t xi[SAMPLE_CHUNK_SIZE];
+    int sample = read_chunk(audio, x, xi);
     if (sample == -1)
     {
-      perror("audio");
-      return EXIT_FAILURE;
+      return -1;
     }
 
     if (sample == 0)
@@ -443,112 +773,1850 @@ int main(int argc, const char *argv[])
       break;
     }
 
-    sample /= sizeof(float);
-    while (sample < SAMPLE_CHUNK_SIZE)
+    if (detail)
     {
-      x[sample++] = 0.0;
+      for (int i = 0; i < sample; i++)
+      {
+        float val = use_lut(audio) ? xi[i] / 32768.0f : x[i];
+        float mag = fabsf(val);
+        hist[mag < 1.0f ? (int)(mag * 32768.0f) : 0x8000]++;
+        square_sum += val * val;
+      }
+      count += sample;
     }
 
-    for (sample = 0; sample < SAMPLE_CHUNK_SIZE; sample++)
+    if (use_lut(audio))
     {
-      float val;
-      if (x[sample] < 0.0)
-      {
-        val = x[sample] / sample_min;
-      }
-      else
+      for (sample = 0; sample < SAMPLE_CHUNK_SIZE; sample++)
       {
-        val = x[sample] / sample_max;
-      }
-      if (val > visual_max)
-      {
-        visual_max = val;
+        if (xi[sample] < level->min_i)
+        {
+          level->min_i = xi[sample];
+        }
+        else if (xi[sample] > level->max_i)
+        {
+          level->max_i = xi[sample];
+        }
       }
+      level->min = level->min_i / 32768.0f;
+      level->max = level->max_i / 32768.0f;
     }
-    if (visual_max > 1.0)
-    {
-      visual_max = 1.0;
-    }
-    sample = 0;
-
-    uint8_t y[OUTPUT_CHUNK_SIZE];
-    for (int i = 0; i < OUTPUT_CHUNK_SIZE; i++)
+    else
     {
-      if (i == VISUAL_CHUNK_INDX)
+      for (sample = 0; sample < SAMPLE_CHUNK_SIZE; sample++)
       {
-        if (visual_val == -1)
+        if (x[sample] < level->min)
         {
-          if (visual == level_meter)
-          {
-            int val = (int)(visual_max * (PIXEL_MID_POS - PIXEL_MIN_POS) * 2.0);
-            if (val < visual_level)
-            {
-              visual_level -= 2;
-              if (visual_level < 0)
-              {
-                visual_level = 0;
-              }
-            }
-            else
-            {
-              visual_level += (val - visual_level) / 5;
-            }
-            visual_val = visual_level;
-          }
-          else
-          {
-            visual_val = (int)(offset * VISUAL_NUM_VAL / (sample_size + 1));
-          }
-          y[i] = visual_base[visual_val & ~1];
+          level->min = x[sample];
         }
-        else
+        else if (x[sample] > level->max)
         {
-          y[i] = visual_base[visual_val | 1];
-          visual_max = 0.0;
-          visual_val = -1;
+          level->max = x[sample];
         }
-        continue;
       }
+    }
 
-      int32_t sample_val = (int32_t)((x[sample]  - sample_min) /
-                                     (sample_max - sample_min) * SAMPLE_MAX_VAL);
+    level->samples += SAMPLE_CHUNK_SIZE;
 
-      if (sample_val < 0)
+    show_progress("evaluating", level->samples, audio->rate);
+  }
+
+  if (verbose)
+  {
+    fprintf(stderr, "\n");
+  }
+
+  if (detail && count)
+  {
+    uint64_t sum = 0;
+    int bin = 0;
+    while (bin < 0x8000 && (sum += hist[bin]) < count - count / 1000)
+    {
+      bin++;
+    }
+    level->pct = bin / 32768.0f;
+    level->rms = (float)sqrt(square_sum / count);
+  }
+  return 0;
+}
+
+// Generate the stream with the level of the audio determined in a separate
+// pass - unless the level is given via <album>.
+int generate(struct audio *audio, int cover, int a2str,
+             const struct options *options, const struct level *album)
+{
+  enum visual visual = options->visual;
+
+  if (cover == -1)
+  {
+    fprintf(stderr, "cover not found: using default\n\n");
+  }
+  else
+  {
+    if (read(cover, dhgr, sizeof(dhgr)) != sizeof(dhgr))
+    {
+      perror("cover");
+      return EXIT_FAILURE;
+    }
+
+    for (int i = 0; i < sizeof(lines) / sizeof(lines[0]); i++)
+    {
+      memset(dhgr + lines[i], PIXEL_BLACK, 40);
+    }
+  }
+
+  uint8_t type[2] = {STREAM_TYPE_MAJOR, options->doc     ? STREAM_TYPE_DOC   :
+                                         options->compact ? STREAM_TYPE_PARAM
+                                                          : STREAM_TYPE_MINOR};
+  type[1] |= options->machine->type;
+  if (options->cache)
+  {
+    type[1] |= STREAM_TYPE_CACHE;
+  }
+  if (write(a2str, type, sizeof(type)) != sizeof(type))
+  {
+    perror("a2str");
+    return EXIT_FAILURE;
+  }
+
+  if (options->cache)
+  {
+    uint32_t hash = cover_hash();
+    uint8_t bytes[4] = {hash, hash >> 8, hash >> 16, hash >> 24};
+    if (write(a2str, bytes, sizeof(bytes)) != sizeof(bytes))
+    {
+      perror("a2str");
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (write(a2str, dhgr, sizeof(dhgr)) != sizeof(dhgr))
+  {
+    perror("a2str");
+    return EXIT_FAILURE;
+  }
+
+  if (options->doc)
+  {
+    // no visualization
+  }
+  else if (options->compact)
+  {
+    if (!write_param(a2str, visual))
+    {
+      return EXIT_FAILURE;
+    }
+  }
+  else if (visual == level_meter)
+  {
+      write_level_meter(a2str);
+  }
+  else if (visual == progress_bar)
+  {
+      write_progress_bar(a2str);
+  }
+
+  uint8_t sample_base[SAMPLE_CHUNK_SIZE];
+  for (int i = 0; i < SAMPLE_CHUNK_SIZE; i++)
+  {
+    sample_base[i] = i <  SAMPLE_LO_2_HI ||
+                     i >= SAMPLE_HI_2_LO ? SAMPLE_LO_BASE
+                                         : SAMPLE_HI_BASE;
+  }
+
+  uint8_t visual_base[VISUAL_NUM_VAL];
+  for (int i = 0; i < VISUAL_NUM_VAL; i++)
+  {
+    visual_base[i] = i < VISUAL_LO_2_HI ? VISUAL_LO_BASE + i
+                                        : VISUAL_HI_BASE + i - VISUAL_LO_2_HI;
+  }
+
+  struct level level;
+  if (album)
+  {
+    level = *album;
+  }
+  else if (rewind_audio(audio) == -1 || evaluate(audio, &level, false) == -1)
+  {
+    perror("audio");
+    return EXIT_FAILURE;
+  }
+
+  if (rewind_audio(audio) == -1)
+  {
+    perror("audio");
+    return EXIT_FAILURE;
+  }
+
+  uint64_t sample_size = level.samples;
+  float sample_min = level.min;
+  float sample_max = level.max;
+
+  // Only amplify, never quiten - even if that means clipping!
+  if (sample_min < -1.0)
+  {
+    sample_min = -1.0;
+  }
+  if (sample_max > 1.0)
+  {
+    sample_max = 1.0;
+  }
+
+  static uint8_t lut[0x10000];
+  if (use_lut(audio))
+  {
+    sample_min = level.min_i / 32768.0f;
+    sample_max = level.max_i / 32768.0f;
+
+    for (int i = INT16_MIN; i <= INT16_MAX; i++)
+    {
+      lut[(uint16_t)i] = options->doc ? quantize_doc(i / 32768.0f, sample_min, sample_max)
+                                      : (uint8_t)quantize(i / 32768.0f, sample_min, sample_max);
+    }
+  }
+
+  uint64_t offset = 0;
+  float visual_max = 0.0;
+  int visual_val = -1;
+  int visual_level = 0;
+
+  uint64_t val_dist[SAMPLE_MAX_VAL + 1];
+  memset(val_dist, 0, sizeof(val_dist));
+
+  static struct chunks chunks;
+  chunks.file = a2str;
+  chunks.len  = 0;
+
+  while (true)
+  {
+    float x[SAMPLE_CHUNK_SIZE];
+    int16_t xi[SAMPLE_CHUNK_SIZE];
+    int sample = read_chunk(audio, x, xi);
+    if (sample == -1)
+    {
+      perror("audio");
+      return EXIT_FAILURE;
+    }
+
+    if (sample == 0)
+    {
+      break;
+    }
+
+    if (options->doc)
+    {
+      uint8_t y[SAMPLE_CHUNK_SIZE];
+      for (sample = 0; sample < SAMPLE_CHUNK_SIZE; sample++)
+      {
+        y[sample] = use_lut(audio) ? lut[(uint16_t)xi[sample]]
+                                   : quantize_doc(x[sample], sample_min, sample_max);
+      }
+      if (!write_chunks(&chunks, y, SAMPLE_CHUNK_SIZE))
+      {
+        perror("a2str");
+        return EXIT_FAILURE;
+      }
+      offset += SAMPLE_CHUNK_SIZE;
+      show_progress("generating", offset, audio->rate);
+      continue;
+    }
+
+    if (use_lut(audio))
+    {
+      // The visualization only depends on the chunk peaks
+      int16_t peak_min = 0;
+      int16_t peak_max = 0;
+      for (sample = 0; sample < SAMPLE_CHUNK_SIZE; sample++)
+      {
+        if (xi[sample] < peak_min)
+        {
+          peak_min = xi[sample];
+        }
+        else if (xi[sample] > peak_max)
+        {
+          peak_max = xi[sample];
+        }
+      }
+      x[0] = peak_min / 32768.0f;
+      x[1] = peak_max / 32768.0f;
+    }
+
+    int peaks = use_lut(audio) ? 2 : SAMPLE_CHUNK_SIZE;
+    for (sample = 0; sample < peaks; sample++)
+    {
+      float val;
+      if (x[sample] < 0.0)
+      {
+        val = x[sample] / sample_min;
+      }
+      else
+      {
+        val = x[sample] / sample_max;
+      }
+      if (val > visual_max)
       {
-        sample_val = 0;
+        visual_max = val;
       }
-      else if (sample_val > SAMPLE_MAX_VAL)
+    }
+    if (visual_max > 1.0)
+    {
+      visual_max = 1.0;
+    }
+    sample = 0;
+
+    uint8_t y[OUTPUT_CHUNK_SIZE];
+    for (int i = 0; i < OUTPUT_CHUNK_SIZE; i++)
+    {
+      if (i == VISUAL_CHUNK_INDX)
       {
-        sample_val = SAMPLE_MAX_VAL;
+        if (visual_val == -1)
+        {
+          if (visual == level_meter)
+          {
+            int val = (int)(visual_max * (PIXEL_MID_POS - PIXEL_MIN_POS) * 2.0);
+            if (val < visual_level)
+            {
+              visual_level -= 2;
+              if (visual_level < 0)
+              {
+                visual_level = 0;
+              }
+            }
+            else
+            {
+              visual_level += (val - visual_level) / 5;
+            }
+            visual_val = visual_level;
+          }
+          else
+          {
+            visual_val = (int)(offset * VISUAL_NUM_VAL / (sample_size + 1));
+          }
+          y[i] = visual_base[visual_val & ~1];
+        }
+        else
+        {
+          y[i] = visual_base[visual_val | 1];
+          visual_max = 0.0;
+          visual_val = -1;
+        }
+        continue;
       }
+
+      int32_t sample_val = use_lut(audio) ? lut[(uint16_t)xi[sample]]
+                                          : quantize(x[sample], sample_min, sample_max);
       val_dist[sample_val]++;
 
       y[i] = sample_base[sample++] + (uint8_t)sample_val;
     }
 
-    if (write(a2str, y, OUTPUT_CHUNK_SIZE) != OUTPUT_CHUNK_SIZE)
+    if (!write_chunks(&chunks, y, OUTPUT_CHUNK_SIZE))
     {
       perror("a2str");
       return EXIT_FAILURE;
     }
     offset += SAMPLE_CHUNK_SIZE;
 
-    uint32_t h = (uint32_t)(offset / 22050 / 3600);
-    uint32_t m = (uint32_t)(offset / 22050 /   60 % 60);
-    uint32_t s = (uint32_t)(offset / 22050        % 60);
-    fprintf(stderr, "generating: %02" PRIu32 ":%02" PRIu32 ":%02" PRIu32 "\r", h, m, s);
+    show_progress("generating", offset, audio->rate);
   }
 
-  fprintf(stderr, "\n\npulse width distribution:\n");
-  for (int i = 0; i <= SAMPLE_MAX_VAL; i++)
+  // The player only plays full pages of DOC samples
+  if (options->doc && offset % 0x100)
+  {
+    uint8_t silence[0x100];
+    memset(silence, 0x80, sizeof(silence));
+    if (!write_chunks(&chunks, silence, 0x100 - offset % 0x100))
+    {
+      perror("a2str");
+      return EXIT_FAILURE;
+    }
+  }
+  if (!flush_chunks(&chunks))
   {
-    fprintf(stderr, "%02" PRIu32 "   %20" PRIu64 "\n", i, val_dist[i]);
+    perror("a2str");
+    return EXIT_FAILURE;
   }
 
-  close(a2str);
+  if (verbose && options->doc)
+  {
+    fprintf(stderr, "\n");
+  }
+  else if (verbose)
+  {
+    fprintf(stderr, "\n\npulse width distribution:\n");
+    for (int i = 0; i <= SAMPLE_MAX_VAL; i++)
+    {
+      fprintf(stderr, "%02" PRIu32 "   %20" PRIu64 "\n", i, val_dist[i]);
+    }
+  }
   return EXIT_SUCCESS;
 }
 
+#ifdef __linux__
+
+#define PACK_SIGNATURE "A2SZ"
+#define PACK_SIZE      (256 * OUTPUT_CHUNK_SIZE)
+#define PACK_ENTRY     16
+
+void put_le(uint8_t *bytes, uint64_t value, int size)
+{
+  for (int i = 0; i < size; i++)
+  {
+    bytes[i] = (uint8_t)(value >> i * 8);
+  }
+}
+
+// Compress the .A2Stream file <a2s_name> into the .A2SZ file <name>
+int pack(const char *a2s_name, const char *name)
+{
+  int a2str = open(a2s_name, O_RDONLY);
+  if (a2str == -1)
+  {
+    perror("a2str");
+    return EXIT_FAILURE;
+  }
+
+  // The first frame ends where the sample data chunks start
+  struct stat st;
+  uint8_t type[2] = {0};
+  if (fstat(a2str, &st) == -1 || read(a2str, type, sizeof(type)) != sizeof(type))
+  {
+    perror("a2str");
+    close(a2str);
+    return EXIT_FAILURE;
+  }
+  uint64_t size = st.st_size;
+  uint64_t head = sizeof(type) + sizeof(dhgr);
+  if (type[1] & STREAM_TYPE_CACHE)
+  {
+    head += sizeof(uint32_t);
+  }
+  if ((type[1] & ~STREAM_TYPE_FLAGS) == STREAM_TYPE_MINOR)
+  {
+    head += VISUAL_NUM_VAL / 2 * 80;
+  }
+  else if ((type[1] & ~STREAM_TYPE_FLAGS) == STREAM_TYPE_PARAM)
+  {
+    head += 8;
+  }
+  if (head > size)
+  {
+    head = size;
+  }
+  assert(head <= PACK_SIZE);
+
+  uint32_t frames = (uint32_t)(1 + (size - head + PACK_SIZE - 1) / PACK_SIZE);
+  size_t index_size = (frames + 1) * PACK_ENTRY + sizeof(uint32_t) + strlen(PACK_SIGNATURE);
+  uint8_t *index = malloc(index_size);
+  static uint8_t raw[PACK_SIZE];
+  static uint8_t frame[PACK_SIZE + PACK_SIZE / 16 + 64];
+
+  char temp[FILENAME_MAX];
+  snprintf(temp, sizeof(temp), "%s.%d.tmp", name, (int)getpid());
+  int a2sz = open(temp, O_WRONLY | O_CREAT | O_TRUNC, S_IREAD | S_IWRITE);
+  if (a2sz == -1 || !index)
+  {
+    perror("a2sz");
+    close(a2str);
+    if (a2sz != -1)
+    {
+      close(a2sz);
+      remove(temp);
+    }
+    free(index);
+    return EXIT_FAILURE;
+  }
+
+  int result = EXIT_SUCCESS;
+  uint64_t offset = 0;
+  uint64_t packed = strlen(PACK_SIGNATURE);
+  if (write(a2sz, PACK_SIGNATURE, packed) != packed)
+  {
+    result = EXIT_FAILURE;
+  }
+
+  for (uint32_t i = 0; i < frames && result == EXIT_SUCCESS; i++)
+  {
+    size_t len = (size_t)(i ? size - offset < PACK_SIZE ? size - offset : PACK_SIZE : head);
+    uLongf frame_len = sizeof(frame);
+
+    put_le(index + i * PACK_ENTRY,     offset, 8);
+    put_le(index + i * PACK_ENTRY + 8, packed, 8);
+
+    if (pread(a2str, raw, len, offset) != len ||
+        compress2(frame, &frame_len, raw, len, Z_BEST_COMPRESSION) != Z_OK ||
+        write(a2sz, frame, frame_len) != frame_len)
+    {
+      result = EXIT_FAILURE;
+    }
+    offset += len;
+    packed += frame_len;
+  }
+
+  put_le(index + frames * PACK_ENTRY,     offset, 8);
+  put_le(index + frames * PACK_ENTRY + 8, packed, 8);
+  put_le(index + (frames + 1) * PACK_ENTRY, frames, 4);
+  memcpy(index + (frames + 1) * PACK_ENTRY + 4, PACK_SIGNATURE, strlen(PACK_SIGNATURE));
+
+  if (result == EXIT_SUCCESS && write(a2sz, index, index_size) != index_size)
+  {
+    result = EXIT_FAILURE;
+  }
+  free(index);
+  close(a2str);
+
+  if (result != EXIT_SUCCESS)
+  {
+    perror("a2sz");
+  }
+  if (close(a2sz) == -1 && result == EXIT_SUCCESS)
+  {
+    perror("a2sz");
+    result = EXIT_FAILURE;
+  }
+  if (result == EXIT_SUCCESS && rename(temp, name) == -1)
+  {
+    perror("a2sz");
+    result = EXIT_FAILURE;
+  }
+  if (result != EXIT_SUCCESS)
+  {
+    remove(temp);
+  }
+  else if (verbose)
+  {
+    fprintf(stderr, "\ncompressed: %" PRIu64 "%%\n", packed * 100 / size);
+  }
+  return result;
+}
+
+#endif // __linux__
+
+int encode(const char *audio_name, const struct options *options,
+           const struct level *album)
+{
+  // Start every file with the default cover as generate() overwrites it
+  // with the cover of the file - if there's one
+  static uint8_t default_dhgr[sizeof(dhgr)];
+  static bool saved = false;
+  if (!saved)
+  {
+    memcpy(default_dhgr, dhgr, sizeof(dhgr));
+    saved = true;
+  }
+  else
+  {
+    memcpy(dhgr, default_dhgr, sizeof(dhgr));
+  }
+
+  int audio = open(audio_name, O_RDONLY | O_BINARY);
+  if (verbose)
+  {
+    fprintf(stderr, "audio: %s\n", audio_name);
+  }
+  if (audio == -1)
+  {
+    perror("audio");
+    return EXIT_FAILURE;
+  }
+
+  char base[256];
+  if (snprintf(base, sizeof(base), "%s", audio_name) >= sizeof(base))
+  {
+    fprintf(stderr, "path too long: %s\n", audio_name);
+    close(audio);
+    return EXIT_FAILURE;
+  }
+  char *dot = strrchr(base, '.');
+  if (dot)
+  {
+    *dot = '\0';
+  }
+  char name[sizeof(base) + 16];
+
+  sprintf(name, "%s.dhgr", base);
+  int cover = open(name, O_RDONLY | O_BINARY);
+  if (verbose)
+  {
+    fprintf(stderr, "cover: %s\n", name);
+  }
+
+  // Generate into a temporary file and rename it when done, so that
+  // an HTTP server never delivers a partially written .a2stream file.
+  // The process id keeps concurrent encodings of the same file apart.
+  char temp[sizeof(name) + 16];
+  sprintf(name, "%s.%s", base, options->packed ? "a2sz" : "a2stream");
+  sprintf(temp, "%s.a2stream.%d.tmp", base, (int)getpid());
+  int a2str = open(temp, O_WRONLY | O_BINARY | O_CREAT | O_TRUNC,
+                         S_IREAD | S_IWRITE);
+  if (verbose)
+  {
+    fprintf(stderr, "a2str: %s\n\n", name);
+  }
+  if (a2str == -1)
+  {
+    perror("a2str");
+    close(audio);
+    if (cover != -1)
+    {
+      close(cover);
+    }
+    return EXIT_FAILURE;
+  }
+
+  static struct audio input;
+  init_audio(&input, audio, options->pcm16, options->machine);
+
+  int result = generate(&input, cover, a2str, options, album);
+
+  close(audio);
+  if (cover != -1)
+  {
+    close(cover);
+  }
+  if (close(a2str) == -1)
+  {
+    perror("a2str");
+    result = EXIT_FAILURE;
+  }
+
+#ifdef __linux__
+  if (result == EXIT_SUCCESS && options->packed)
+  {
+    result = pack(temp, name);
+    remove(temp);
+    return result;
+  }
+#endif
+
+  if (result == EXIT_SUCCESS)
+  {
+#ifdef _WIN32
+    // Windows rename() doesn't replace an existing file
+    remove(name);
+#endif
+    if (rename(temp, name) == -1)
+    {
+      perror("a2str");
+      result = EXIT_FAILURE;
+    }
+  }
+  if (result != EXIT_SUCCESS)
+  {
+    remove(temp);
+  }
+  return result;
+}
+
+//
+// The album mode encodes a set of audio files with a common level instead of
+// the level of each file. So all files play with the same gain relative to
+// each other. Every file is read twice: Once to determine its level and once
+// to encode it. On Linux, both passes are done for all files in parallel by
+// separate worker processes with up to one worker per CPU.
+//
+
+int analyze(const char *audio_name, const struct options *options,
+            struct level *level)
+{
+  int audio = open(audio_name, O_RDONLY | O_BINARY);
+  if (audio == -1)
+  {
+    perror(audio_name);
+    return EXIT_FAILURE;
+  }
+
+  static struct audio input;
+  init_audio(&input, audio, options->pcm16, options->machine);
+
+  int result = rewind_audio(&input) == -1 ||
+               evaluate(&input, level, true) == -1 ? EXIT_FAILURE : EXIT_SUCCESS;
+  if (result != EXIT_SUCCESS)
+  {
+    perror(audio_name);
+  }
+  close(audio);
+  return result;
+}
+
+float decibel(float val)
+{
+  return val > 0.0f ? 20.0f * log10f(val) : -99.9f;
+}
+
+#ifdef __linux__
+
+// Analyze the files in parallel, each worker returns the level via a pipe
+bool analyze_all(int files, const char *file[], const struct options *options,
+                 long workers, struct level *level, bool *ok)
+{
+  pid_t *pid = calloc(files, sizeof(pid_t));
+  int *fd = calloc(files, sizeof(int));
+  bool result = pid && fd;
+  if (!result)
+  {
+    fprintf(stderr, "out of memory\n");
+  }
+
+  int next = 0, done = 0;
+  long running = 0;
+  while (result && done < files)
+  {
+    while (next < files && running < workers)
+    {
+      int pipefd[2];
+      if (pipe(pipefd) == -1)
+      {
+        perror("pipe");
+        result = false;
+        break;
+      }
+      pid[next] = fork();
+      if (pid[next] == -1)
+      {
+        perror("fork");
+        close(pipefd[0]);
+        close(pipefd[1]);
+        result = false;
+        break;
+      }
+      if (pid[next] == 0)
+      {
+        close(pipefd[0]);
+        int result = analyze(file[next], options, &level[next]);
+        if (result == EXIT_SUCCESS &&
+            write(pipefd[1], &level[next], sizeof(struct level)) != sizeof(struct level))
+        {
+          result = EXIT_FAILURE;
+        }
+        _exit(result);
+      }
+      close(pipefd[1]);
+      fd[next++] = pipefd[0];
+      running++;
+    }
+    if (!result)
+    {
+      break;
+    }
+
+    int status;
+    pid_t finished = wait(&status);
+    if (finished == -1)
+    {
+      perror("wait");
+      result = false;
+      break;
+    }
+    for (int i = 0; i < next; i++)
+    {
+      if (pid[i] == finished)
+      {
+        ok[i] = WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS &&
+                read(fd[i], &level[i], sizeof(struct level)) == sizeof(struct level);
+        close(fd[i]);
+        running--;
+        done++;
+      }
+    }
+  }
+  free(fd);
+  free(pid);
+  return result;
+}
+
+// Encode the files in parallel
+int encode_all(int files, const char *file[], const struct options *options,
+               long workers, const struct level *level, const struct level *common)
+{
+  pid_t *pid = calloc(files, sizeof(pid_t));
+  if (!pid)
+  {
+    fprintf(stderr, "out of memory\n");
+    return EXIT_FAILURE;
+  }
+
+  int result = EXIT_SUCCESS;
+  int next = 0;
+  long running = 0;
+  while (next < files || running)
+  {
+    while (next < files && running < workers)
+    {
+      struct level own = *common;
+      own.samples = level[next].samples;
+
+      fprintf(stderr, "encoding: %s\n", file[next]);
+      pid[next] = fork();
+      if (pid[next] == -1)
+      {
+        perror("fork");
+        free(pid);
+        return EXIT_FAILURE;
+      }
+      if (pid[next] == 0)
+      {
+        _exit(encode(file[next], options, &own));
+      }
+      next++;
+      running++;
+    }
+
+    int status;
+    pid_t finished = wait(&status);
+    if (finished == -1)
+    {
+      perror("wait");
+      free(pid);
+      return EXIT_FAILURE;
+    }
+    for (int i = 0; i < next; i++)
+    {
+      if (pid[i] == finished)
+      {
+        bool encoded = WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS;
+        fprintf(stderr, "%s: %s\n", encoded ? "encoded" : "failed", file[i]);
+        if (!encoded)
+        {
+          result = EXIT_FAILURE;
+        }
+        running--;
+      }
+    }
+  }
+  free(pid);
+  return result;
+}
+
+#endif // __linux__
+
+int album(int files, const char *file[], const struct options *options)
+{
+  struct level *level = calloc(files, sizeof(struct level));
+  bool *ok = calloc(files, sizeof(bool));
+  if (!level || !ok)
+  {
+    fprintf(stderr, "out of memory\n");
+    free(ok);
+    free(level);
+    return EXIT_FAILURE;
+  }
+
+#ifdef __linux__
+  long workers = sysconf(_SC_NPROCESSORS_ONLN);
+  if (workers < 1)
+  {
+    workers = 1;
+  }
+  fprintf(stderr, "workers: %ld\n\n", workers);
+  verbose = false;
+
+  if (!analyze_all(files, file, options, workers, level, ok))
+  {
+    free(ok);
+    free(level);
+    return EXIT_FAILURE;
+  }
+#else
+  for (int i = 0; i < files; i++)
+  {
+    fprintf(stderr, "analyzing: %s\n", file[i]);
+    ok[i] = analyze(file[i], options, &level[i]) == EXIT_SUCCESS;
+  }
+  fprintf(stderr, "\n");
+#endif
+
+  // The common level covers the peaks of all files
+  struct level common = {0};
+  for (int i = 0; i < files; i++)
+  {
+    if (!ok[i])
+    {
+      fprintf(stderr, "failed: %s\n", file[i]);
+      free(ok);
+      free(level);
+      return EXIT_FAILURE;
+    }
+    if (level[i].min < common.min)
+    {
+      common.min = level[i].min;
+    }
+    if (level[i].max > common.max)
+    {
+      common.max = level[i].max;
+    }
+    if (level[i].min_i < common.min_i)
+    {
+      common.min_i = level[i].min_i;
+    }
+    if (level[i].max_i > common.max_i)
+    {
+      common.max_i = level[i].max_i;
+    }
+  }
+
+  // Only amplify, never quiten - like generate()
+  float peak = fmaxf(-common.min, common.max);
+  float gain = peak > 0.0f && peak < 1.0f ? 1.0f / peak : 1.0f;
+
+  fprintf(stderr, "  peak  99.9%%    rms  (dBFS)\n");
+  for (int i = 0; i < files; i++)
+  {
+    fprintf(stderr, "%6.1f %6.1f %6.1f  %s\n",
+            decibel(fmaxf(-level[i].min, level[i].max)),
+            decibel(level[i].pct), decibel(level[i].rms), file[i]);
+  }
+  fprintf(stderr, "\nalbum gain: %+.1f dB\n\n", decibel(gain));
+
+#ifdef __linux__
+  int result = encode_all(files, file, options, workers, level, &common);
+#else
+  int result = EXIT_SUCCESS;
+  for (int i = 0; i < files; i++)
+  {
+    struct level own = common;
+    own.samples = level[i].samples;
+
+    if (encode(file[i], options, &own) != EXIT_SUCCESS)
+    {
+      result = EXIT_FAILURE;
+    }
+  }
+#endif
+
+  free(ok);
+  free(level);
+  return result;
+}
+
+#ifdef __linux__
+
+//
+// The watch mode encodes every .RAW audio data input file that shows up or
+// changes in one of the watched directories. A file is considered complete
+// once its writer has closed it (or it was moved into the directory) and no
+// further write activity happened for WATCH_SETTLE seconds. Files that are
+// still being written are therefore deferred until the upload finishes.
+//
+// Every file is encoded by a separate worker process with up to one worker
+// per CPU running at the same time. If a file changes again while its worker
+// is still running, the file is encoded once more afterwards.
+//
+// If the kernel drops events because too many files show up at once, the
+// watched directories are scanned again to queue the files missed.
+//
+
+#define WATCH_MAX_DIRS  16
+#define WATCH_GROW_JOBS 16
+#define WATCH_SETTLE    2
+
+struct job
+{
+  char   path[256];
+  time_t active;    // time of last write activity
+  bool   closed;    // writer has closed the file
+  bool   pending;   // file needs to be (re-)encoded
+  pid_t  pid;       // worker encoding the file
+};
+
+struct job *jobs;
+int num_jobs;
+
+bool is_audio(const char *name)
+{
+  size_t len = strlen(name);
+  return len > 4 && !strcasecmp(name + len - 4, ".raw");
+}
+
+void watch_queue(const char *dir, const char *name, bool closed)
+{
+  char path[sizeof(jobs[0].path)];
+  if (snprintf(path, sizeof(path), "%s/%s", dir, name) >= sizeof(path))
+  {
+    fprintf(stderr, "path too long: %s/%s\n", dir, name);
+    return;
+  }
+
+  struct job *job = NULL;
+  for (int i = 0; i < num_jobs; i++)
+  {
+    if (!strcmp(jobs[i].path, path))
+    {
+      job = &jobs[i];
+      break;
+    }
+    if (!job && !jobs[i].path[0])
+    {
+      job = &jobs[i];
+    }
+  }
+  if (!job)
+  {
+    struct job *more = realloc(jobs, (num_jobs + WATCH_GROW_JOBS) *
+                                     sizeof(struct job));
+    if (!more)
+    {
+      fprintf(stderr, "out of memory: %s\n", path);
+      return;
+    }
+    memset(more + num_jobs, 0, WATCH_GROW_JOBS * sizeof(struct job));
+    jobs = more;
+    job = &jobs[num_jobs];
+    num_jobs += WATCH_GROW_JOBS;
+  }
+
+  if (!job->path[0])
+  {
+    strcpy(job->path, path);
+    fprintf(stderr, "queued: %s\n", path);
+  }
+  job->active  = time(NULL);
+  job->closed  = closed;
+  job->pending = true;
+}
+
+void watch_scan(const char *dir, const char *ext)
+{
+  DIR *d = opendir(dir);
+  if (!d)
+  {
+    perror(dir);
+    return;
+  }
+
+  struct dirent *entry;
+  while ((entry = readdir(d)))
+  {
+    if (!is_audio(entry->d_name))
+    {
+      continue;
+    }
+
+    // Only queue audio files without an up-to-date .a2stream (or .a2sz) file
+    char path[sizeof(jobs[0].path)];
+    struct stat audio, a2str;
+    snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+    if (stat(path, &audio) == -1)
+    {
+      continue;
+    }
+    snprintf(path, sizeof(path), "%s/%.*s.%s", dir,
+             (int)(strlen(entry->d_name) - 4), entry->d_name, ext);
+    if (stat(path, &a2str) == -1 || a2str.st_mtime < audio.st_mtime)
+    {
+      watch_queue(dir, entry->d_name, true);
+    }
+  }
+  closedir(d);
+}
+
+int watch(int dirs, const char *dir[], const struct options *options)
+{
+  if (dirs > WATCH_MAX_DIRS)
+  {
+    fprintf(stderr, "too many directories\n");
+    return EXIT_FAILURE;
+  }
+
+  int notify = inotify_init1(IN_CLOEXEC);
+  if (notify == -1)
+  {
+    perror("inotify");
+    return EXIT_FAILURE;
+  }
+
+  int wd[WATCH_MAX_DIRS];
+  for (int i = 0; i < dirs; i++)
+  {
+    wd[i] = inotify_add_watch(notify, dir[i],
+                              IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_TO);
+    if (wd[i] == -1)
+    {
+      perror(dir[i]);
+      return EXIT_FAILURE;
+    }
+    fprintf(stderr, "watching: %s\n", dir[i]);
+    watch_scan(dir[i], options->packed ? "a2sz" : "a2stream");
+  }
+
+  long workers = sysconf(_SC_NPROCESSORS_ONLN);
+  if (workers < 1)
+  {
+    workers = 1;
+  }
+  fprintf(stderr, "workers: %ld\n\n", workers);
+
+  verbose = false;
+
+  while (true)
+  {
+    struct pollfd fd = {notify, POLLIN, 0};
+    if (poll(&fd, 1, 1000) == -1 && errno != EINTR)
+    {
+      perror("poll");
+      return EXIT_FAILURE;
+    }
+
+    if (fd.revents & POLLIN)
+    {
+      char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+      ssize_t len = read(notify, buf, sizeof(buf));
+      if (len == -1 && errno != EINTR)
+      {
+        perror("inotify");
+        return EXIT_FAILURE;
+      }
+
+      for (char *ptr = buf; ptr < buf + len;
+           ptr += sizeof(struct inotify_event) + ((struct inotify_event *)ptr)->len)
+      {
+        struct inotify_event *event = (struct inotify_event *)ptr;
+        if (event->mask & IN_Q_OVERFLOW)
+        {
+          fprintf(stderr, "events lost, rescanning\n");
+          for (int i = 0; i < dirs; i++)
+          {
+            watch_scan(dir[i], options->packed ? "a2sz" : "a2stream");
+          }
+          continue;
+        }
+        if (!event->len || !is_audio(event->name))
+        {
+          continue;
+        }
+        for (int i = 0; i < dirs; i++)
+        {
+          if (wd[i] == event->wd)
+          {
+            watch_queue(dir[i], event->name,
+                        event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO));
+          }
+        }
+      }
+    }
+
+    // Reap finished workers
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+    {
+      for (int i = 0; i < num_jobs; i++)
+      {
+        if (jobs[i].pid == pid)
+        {
+          bool ok = WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS;
+          fprintf(stderr, "%s: %s\n", ok ? "encoded" : "failed", jobs[i].path);
+          jobs[i].pid = 0;
+          if (!jobs[i].pending)
+          {
+            jobs[i].path[0] = '\0';
+          }
+        }
+      }
+    }
+
+    // Start workers for files that are complete
+    long running = 0;
+    for (int i = 0; i < num_jobs; i++)
+    {
+      if (jobs[i].pid)
+      {
+        running++;
+      }
+    }
+
+    time_t now = time(NULL);
+    for (int i = 0; i < num_jobs && running < workers; i++)
+    {
+      struct job *job = &jobs[i];
+      if (!job->pending || job->pid || !job->closed ||
+          now - job->active < WATCH_SETTLE)
+      {
+        continue;
+      }
+
+      fprintf(stderr, "encoding: %s\n", job->path);
+      pid = fork();
+      if (pid == -1)
+      {
+        perror("fork");
+        break;
+      }
+      if (pid == 0)
+      {
+        close(notify);
+        _exit(encode(job->path, options, NULL));
+      }
+      job->pid     = pid;
+      job->pending = false;
+      running++;
+    }
+  }
+}
+
+#endif // __linux__
+
+// Apply an encoding option, return false for an unknown option
+bool set_option(char opt, struct options *options)
+{
+  if (opt == 'p')
+  {
+    options->visual = progress_bar;
+  }
+  else if (opt == 'c')
+  {
+    options->compact = true;
+  }
+  else if (opt == 'k')
+  {
+    options->cache = true;
+  }
+  else if (opt == 's')
+  {
+    options->pcm16 = true;
+  }
+  else if (opt == 'n')
+  {
+    options->machine = &machines[1];
+  }
+  else if (opt == 'e')
+  {
+    options->machine = &machines[2];
+  }
+  else if (opt == 'g')
+  {
+    options->doc = true;
+  }
+  else if (opt == 'z')
+  {
+    options->packed = true;
+  }
+  else if (opt != 'v')
+  {
+    return false;
+  }
+
+  // The DOC plays at 22050Hz independent of the machine
+  if (options->doc)
+  {
+    options->machine = &machines[0];
+  }
+  return true;
+}
+
+const struct options default_options = {level_meter, &machines[0], false, false, false, false, false};
+
+#ifdef __linux__
+
+//
+// The distributed mode encodes a set of audio files on several machines. The
+// coordinator (option -d) hands out one file at a time to every connected
+// worker (option -j). All machines access the files with the same absolute
+// path on shared storage (e.g. an NFS share). So a worker just receives the
+// path and writes the .a2stream file beside the audio file as usual.
+//
+// The protocol consists of text lines over TCP:
+//
+//   coordinator -> worker:  job <id> <options> <path>
+//   worker -> coordinator:  progress <id> <stage> <seconds>
+//                           done <id>
+//                           failed <id> <last error message>
+//
+// A worker runs one job per CPU, each with a separate connection. It reports
+// the progress at least every DIST_BEAT seconds while encoding. It stops
+// encoding if the coordinator closes the connection meanwhile. If a worker
+// disconnects or doesn't report for DIST_TIMEOUT seconds, its job is handed
+// out again up to DIST_TRIES times. Once all jobs are done the coordinator
+// closes all connections, which makes the workers terminate.
+//
+
+#define DIST_MAX_WORKERS 256
+#define DIST_TRIES       3
+#define DIST_BEAT        10
+#define DIST_TIMEOUT     60
+
+enum dist_state {dist_pending, dist_running, dist_done, dist_failed};
+
+struct dist_job
+{
+  char            path[PATH_MAX];
+  uint64_t        seconds;  // audio duration
+  enum dist_state state;
+  int             tries;
+};
+
+struct dist_worker
+{
+  int    sock;       // -1 if slot is unused
+  int    job;        // job being encoded, -1 if idle
+  time_t active;     // time of last message
+  char   name[64];   // peer address
+  char   line[PATH_MAX + 64];
+  size_t len;
+};
+
+// Connection to the coordinator while encoding a job as worker
+int dist_sock = -1;
+int dist_job;
+
+void report_progress(const char *stage, uint64_t seconds)
+{
+  static time_t last;
+  time_t now = time(NULL);
+
+  if (dist_sock == -1 || now - last < DIST_BEAT)
+  {
+    return;
+  }
+  last = now;
+
+  char line[64];
+  int len = snprintf(line, sizeof(line), "progress %d %s %" PRIu64 "\n",
+                     dist_job, stage, seconds);
+  send(dist_sock, line, len, MSG_NOSIGNAL);
+}
+
+bool dist_send(struct dist_worker *worker, const char *line)
+{
+  return send(worker->sock, line, strlen(line), MSG_NOSIGNAL) == strlen(line);
+}
+
+void dist_lost(struct dist_worker *worker, struct dist_job *jobs)
+{
+  fprintf(stderr, "worker lost: %s\n", worker->name);
+  if (worker->job != -1)
+  {
+    struct dist_job *job = &jobs[worker->job];
+    job->state = ++job->tries < DIST_TRIES ? dist_pending : dist_failed;
+    fprintf(stderr, "%s: %s\n", job->state == dist_pending ? "requeued" : "failed",
+                                job->path);
+  }
+  close(worker->sock);
+  worker->sock = -1;
+}
+
+void dist_message(struct dist_worker *worker, struct dist_job *jobs)
+{
+  char stage[16];
+  uint64_t seconds;
+  int id, reason = 0;
+
+  if (sscanf(worker->line, "progress %d %15s %" SCNu64, &id, stage, &seconds) == 3 &&
+      id == worker->job)
+  {
+    uint64_t total = jobs[id].seconds ? jobs[id].seconds : 1;
+    fprintf(stderr, "%s: %3" PRIu64 "%%  %s\n", stage,
+            seconds < total ? seconds * 100 / total : 100, jobs[id].path);
+  }
+  else if (sscanf(worker->line, "done %d", &id) == 1 && id == worker->job)
+  {
+    jobs[id].state = dist_done;
+    worker->job = -1;
+    fprintf(stderr, "encoded: %s (%s)\n", jobs[id].path, worker->name);
+  }
+  else if (sscanf(worker->line, "failed %d %n", &id, &reason) == 1 && id == worker->job)
+  {
+    jobs[id].state = dist_failed;
+    worker->job = -1;
+    fprintf(stderr, "failed: %s (%s) %s\n", jobs[id].path, worker->name,
+                    reason ? worker->line + reason : "");
+  }
+}
+
+int distribute(const char *port, int files, const char *file[],
+               const struct options *options, const char *opts)
+{
+  struct dist_job *jobs = calloc(files, sizeof(struct dist_job));
+  static struct dist_worker workers[DIST_MAX_WORKERS];
+  if (!jobs)
+  {
+    fprintf(stderr, "out of memory\n");
+    return EXIT_FAILURE;
+  }
+
+  for (int i = 0; i < files; i++)
+  {
+    struct stat st;
+    if (!realpath(file[i], jobs[i].path) || stat(jobs[i].path, &st) == -1)
+    {
+      perror(file[i]);
+      return EXIT_FAILURE;
+    }
+    jobs[i].seconds = st.st_size / (options->pcm16 ? 2 : 4) / AUDIO_RATE;
+  }
+  for (int i = 0; i < DIST_MAX_WORKERS; i++)
+  {
+    workers[i].sock = -1;
+  }
+
+  struct addrinfo hints = {.ai_family = AF_INET6, .ai_socktype = SOCK_STREAM,
+                           .ai_flags = AI_PASSIVE};
+  struct addrinfo *addr;
+  int on = 1, off = 0;
+  if (getaddrinfo(NULL, port, &hints, &addr))
+  {
+    fprintf(stderr, "invalid port %s\n", port);
+    return EXIT_FAILURE;
+  }
+  int server = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+  if (server == -1 ||
+      setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) ||
+      setsockopt(server, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off)) ||
+      bind(server, addr->ai_addr, addr->ai_addrlen) ||
+      listen(server, SOMAXCONN))
+  {
+    perror("listen");
+    return EXIT_FAILURE;
+  }
+  freeaddrinfo(addr);
+  fprintf(stderr, "distributing: %d files on port %s\n\n", files, port);
+
+  int remaining = files;
+  while (remaining)
+  {
+    struct pollfd fd[1 + DIST_MAX_WORKERS];
+    fd[0] = (struct pollfd){server, POLLIN, 0};
+    for (int i = 0; i < DIST_MAX_WORKERS; i++)
+    {
+      fd[1 + i] = (struct pollfd){workers[i].sock, POLLIN, 0};
+    }
+    if (poll(fd, 1 + DIST_MAX_WORKERS, 1000) == -1 && errno != EINTR)
+    {
+      perror("poll");
+      return EXIT_FAILURE;
+    }
+    time_t now = time(NULL);
+
+    if (fd[0].revents & POLLIN)
+    {
+      struct sockaddr_storage peer;
+      socklen_t peer_len = sizeof(peer);
+      int sock = accept(server, (struct sockaddr *)&peer, &peer_len);
+      int i = 0;
+      while (i < DIST_MAX_WORKERS && workers[i].sock != -1)
+      {
+        i++;
+      }
+      if (sock != -1 && i == DIST_MAX_WORKERS)
+      {
+        close(sock);
+      }
+      else if (sock != -1)
+      {
+        struct dist_worker *worker = &workers[i];
+        char host[48], serv[16];
+        getnameinfo((struct sockaddr *)&peer, peer_len, host, sizeof(host),
+                    serv, sizeof(serv), NI_NUMERICHOST | NI_NUMERICSERV);
+        snprintf(worker->name, sizeof(worker->name), "%s:%s", host, serv);
+        worker->sock   = sock;
+        worker->job    = -1;
+        worker->active = now;
+        worker->len    = 0;
+        fprintf(stderr, "worker joined: %s\n", worker->name);
+      }
+    }
+
+    for (int i = 0; i < DIST_MAX_WORKERS; i++)
+    {
+      struct dist_worker *worker = &workers[i];
+      if (worker->sock == -1)
+      {
+        continue;
+      }
+
+      if (fd[1 + i].revents & (POLLIN | POLLHUP | POLLERR))
+      {
+        ssize_t len = recv(worker->sock, worker->line + worker->len,
+                           sizeof(worker->line) - 1 - worker->len, 0);
+        if (len <= 0)
+        {
+          dist_lost(worker, jobs);
+          continue;
+        }
+        worker->len += len;
+        worker->active = now;
+
+        char *end;
+        while ((end = memchr(worker->line, '\n', worker->len)))
+        {
+          *end = '\0';
+          dist_message(worker, jobs);
+          worker->len -= end + 1 - worker->line;
+          memmove(worker->line, end + 1, worker->len);
+        }
+        if (worker->len == sizeof(worker->line) - 1)
+        {
+          dist_lost(worker, jobs);
+          continue;
+        }
+      }
+
+      if (worker->job != -1 && now - worker->active > DIST_TIMEOUT)
+      {
+        dist_lost(worker, jobs);
+        continue;
+      }
+
+      // Hand out the next pending job to an idle worker
+      for (int j = 0; j < files && worker->job == -1; j++)
+      {
+        if (jobs[j].state == dist_pending)
+        {
+          char line[sizeof(worker->line)];
+          snprintf(line, sizeof(line), "job %d %s %s\n", j, *opts ? opts : "-", jobs[j].path);
+          if (!dist_send(worker, line))
+          {
+            dist_lost(worker, jobs);
+            break;
+          }
+          jobs[j].state  = dist_running;
+          worker->job    = j;
+          worker->active = now;
+          fprintf(stderr, "encoding: %s (%s)\n", jobs[j].path, worker->name);
+        }
+      }
+    }
+
+    remaining = 0;
+    for (int i = 0; i < files; i++)
+    {
+      if (jobs[i].state == dist_pending || jobs[i].state == dist_running)
+      {
+        remaining++;
+      }
+    }
+  }
+
+  for (int i = 0; i < DIST_MAX_WORKERS; i++)
+  {
+    if (workers[i].sock != -1)
+    {
+      close(workers[i].sock);
+    }
+  }
+  close(server);
+
+  int result = EXIT_SUCCESS;
+  fprintf(stderr, "\n");
+  for (int i = 0; i < files; i++)
+  {
+    if (jobs[i].state != dist_done)
+    {
+      fprintf(stderr, "failed: %s\n", jobs[i].path);
+      result = EXIT_FAILURE;
+    }
+  }
+  free(jobs);
+  return result;
+}
+
+// Encode jobs received via connection <sock> until it is closed
+void work_jobs(int sock)
+{
+  FILE *coordinator = fdopen(sock, "r");
+  char line[PATH_MAX + 64];
+
+  while (fgets(line, sizeof(line), coordinator))
+  {
+    char opts[16];
+    int id, path;
+    if (sscanf(line, "job %d %15s %n", &id, opts, &path) != 2)
+    {
+      continue;
+    }
+    line[strcspn(line, "\n")] = '\0';
+
+    // Pass the error messages of the encoder on and keep the last one
+    int err[2];
+    if (pipe(err) == -1)
+    {
+      perror("pipe");
+      break;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+      struct options options = default_options;
+      for (const char *opt = opts; *opt && *opt != '-'; opt++)
+      {
+        set_option(*opt, &options);
+      }
+
+      close(err[0]);
+      dup2(err[1], STDERR_FILENO);
+      close(err[1]);
+      verbose  = false;
+      dist_sock = sock;
+      dist_job  = id;
+      _exit(encode(line + path, &options, NULL));
+    }
+    close(err[1]);
+
+    char reason[128] = "", message[sizeof(reason)];
+    size_t len = 0;
+    bool lost = false;
+    struct pollfd fd[2] = {{err[0], POLLIN, 0}, {sock, POLLIN, 0}};
+    while (pid != -1)
+    {
+      if (poll(fd, 2, -1) == -1 && errno != EINTR)
+      {
+        perror("poll");
+        break;
+      }
+
+      // The coordinator doesn't send anything while a job is running, so
+      // the connection became readable because it was closed
+      if (fd[1].revents)
+      {
+        char c;
+        if (recv(sock, &c, 1, MSG_PEEK | MSG_DONTWAIT) <= 0)
+        {
+          kill(pid, SIGKILL);
+          lost = true;
+        }
+        fd[1].fd = -1;
+      }
+
+      if (fd[0].revents)
+      {
+        char buf[256];
+        ssize_t n = read(err[0], buf, sizeof(buf));
+        if (n <= 0)
+        {
+          break;
+        }
+        fwrite(buf, 1, n, stderr);
+        for (ssize_t i = 0; i < n; i++)
+        {
+          if (buf[i] != '\n')
+          {
+            if (len < sizeof(message) - 1)
+            {
+              message[len++] = buf[i];
+            }
+          }
+          else if (len)
+          {
+            message[len] = '\0';
+            strcpy(reason, message);
+            len = 0;
+          }
+        }
+      }
+    }
+    close(err[0]);
+
+    int status;
+    bool ok = pid != -1 && waitpid(pid, &status, 0) == pid &&
+              WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS;
+    if (lost)
+    {
+      // Remove the temporary file of the killed encoder, see encode()
+      const char *audio = line + path;
+      const char *dot = strrchr(audio, '.');
+      char temp[sizeof(line) + 32];
+      snprintf(temp, sizeof(temp), "%.*s.a2stream.%d.tmp",
+               dot ? (int)(dot - audio) : (int)strlen(audio), audio, (int)pid);
+      remove(temp);
+      break;
+    }
+    snprintf(line, sizeof(line), ok ? "done %d\n" : "failed %d %s\n", id, reason);
+    send(sock, line, strlen(line), MSG_NOSIGNAL);
+  }
+  fclose(coordinator);
+}
+
+int work(const char *address)
+{
+  char host[256];
+  snprintf(host, sizeof(host), "%s", address);
+  char *port = strrchr(host, ':');
+  if (!port)
+  {
+    fprintf(stderr, "missing port: %s\n", address);
+    return EXIT_FAILURE;
+  }
+  *port++ = '\0';
+
+  long workers = sysconf(_SC_NPROCESSORS_ONLN);
+  if (workers < 1)
+  {
+    workers = 1;
+  }
+  fprintf(stderr, "workers: %ld\n", workers);
+
+  for (long i = 0; i < workers; i++)
+  {
+    struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+    struct addrinfo *list, *addr;
+    int sock = -1;
+    if (getaddrinfo(host, port, &hints, &list))
+    {
+      fprintf(stderr, "unknown coordinator: %s\n", address);
+      return EXIT_FAILURE;
+    }
+    for (addr = list; addr; addr = addr->ai_next)
+    {
+      sock = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+      if (sock != -1 && connect(sock, addr->ai_addr, addr->ai_addrlen) == -1)
+      {
+        close(sock);
+        sock = -1;
+      }
+      if (sock != -1)
+      {
+        break;
+      }
+    }
+    freeaddrinfo(list);
+    if (sock == -1)
+    {
+      perror(address);
+      break;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+      work_jobs(sock);
+      _exit(EXIT_SUCCESS);
+    }
+    close(sock);
+    if (pid == -1)
+    {
+      perror("fork");
+      break;
+    }
+  }
+
+  // Wait for the coordinator to close all connections
+  while (wait(NULL) != -1)
+  {
+  }
+  fprintf(stderr, "finished\n");
+  return EXIT_SUCCESS;
+}
+
+#endif // __linux__
+
+int main(int argc, const char *argv[])
+{
+  struct options options = default_options;
+  char opts[16] = "";
+  bool watched = false;
+  bool albumed = false;
+  bool distributed = false;
+  bool joined = false;
+  int arg = 1;
+
+  if (argc > 1 && argv[1][0] == '-')
+  {
+    for (const char *opt = argv[1] + 1; *opt; opt++)
+    {
+      if (*opt == 'w')
+      {
+        watched = true;
+      }
+      else if (*opt == 'a')
+      {
+        albumed = true;
+      }
+      else if (*opt == 'd')
+      {
+        distributed = true;
+      }
+      else if (*opt == 'j')
+      {
+        joined = true;
+      }
+      else if (!set_option(*opt, &options))
+      {
+        arg = argc;
+      }
+      else if (strlen(opts) < sizeof(opts) - 1)
+      {
+        strncat(opts, opt, 1);
+      }
+    }
+    arg++;
+  }
+
+  if (arg >= argc || watched + albumed + distributed + joined > 1 ||
+      (!watched && !albumed && !distributed && argc - arg > 1) ||
+      (distributed && argc - arg < 2))
+  {
+    fprintf(stderr,
+            "usage: %s [option] audio\n"
+            "       option -v: show level meter (default)\n"
+            "              -p: show progress bar\n"
+            "              -c: send visualization parameters instead of templates\n"
+            "              -k: send cover hash to allow for caching the cover\n"
+            "              -s: audio has 16-bit signed samples\n"
+            "              -n: resample for NTSC machines (//e and IIgs)\n"
+            "              -e: resample for PAL machines (European //e)\n"
+            "              -w: watch audio directories (e.g. -w or -wpn)\n"
+            "              -a: encode audio files with a common gain (e.g. -a, -as or -apn)\n"
+            "              -g: 8-bit samples for the IIgs Ensoniq DOC (no visualization)\n"
+            "              -z: write compressed .a2sz file instead of .a2stream file\n"
+            "              -d: distribute audio files to workers (e.g. -dpn 6502 *.raw)\n"
+            "              -j: join coordinator as worker (e.g. -j host:6502)\n"
+            "       audio: headerless 32-bit float (or 16-bit signed with -s) 22050Hz mono samples\n",
+            argv[0]);
+    return EXIT_FAILURE;
+  }
+
+#ifdef __linux__
+  // The coordinator passes its options with every job
+  if (joined)
+  {
+    return work(argv[arg]);
+  }
+#endif
+
+  fprintf(stderr, "\nvisual: %s%s\n", options.doc                   ? "none"        :
+                                      options.visual == level_meter ? "level meter"
+                                                                    : "progress bar",
+                                      options.compact && !options.doc ? " (parameters)" : "");
+  fprintf(stderr, "resampling: %s (%.1f Hz)\n\n", options.machine->name,
+                  options.machine->clock / CYC_MAX);
+
+#ifndef __linux__
+  if (options.packed)
+  {
+    fprintf(stderr, "compressed output requires Linux zlib\n");
+    return EXIT_FAILURE;
+  }
+#endif
+
+  if (watched)
+  {
+#ifdef __linux__
+    return watch(argc - arg, argv + arg, &options);
+#else
+    fprintf(stderr, "watch mode requires Linux inotify\n");
+    return EXIT_FAILURE;
+#endif
+  }
+
+  if (albumed)
+  {
+    return album(argc - arg, argv + arg, &options);
+  }
+
+  if (distributed || joined)
+  {
+#ifdef __linux__
+    return distribute(argv[arg], argc - arg - 1, argv + arg + 1, &options, opts);
+#else
+    fprintf(stderr, "distributed mode requires Linux\n");
+    return EXIT_FAILURE;
+#endif
+  }
+
+  return encode(argv[arg], &options, NULL);
+}
+
 // cover.dhgr
 uint8_t dhgr[] = {
   0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
@@ -153,6 +153,23 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 // other tasks. And the 65C02 allows with PLX + STX to do just that without
 // trashing the accumulator.
 //
+// Looking closer at the former approach, the 2 cycles are saved on the writer
+// side only: LDA DATA + PHA requires 7 cycles per byte while INY + LDA DATA +
+// STA $100,Y requires 11 cycles per byte. On the reader side, LDA $100,X needs
+// an additional DEX, so every single pulse generator pays 2 cycles more than
+// with PLX. Per page that's 256 * 4 cycles saved in the transfer generators
+// versus 255 * 2 cycles spent in all generators.
+// Additionally, with X as read index the sample needs to be read into A or Y,
+// the 65C02 doesn't have an LDX $100,X. Both are in use: A carries the
+// visualization byte from visual_1 to visual_2 and Y is the index for the
+// LDA ($FC),Y in visual_1 - there's no equivalent using X.
+// So the saved cycles can only be reclaimed by transferring 3 bytes per
+// transfer generator and by moving the visualization index to the zero page,
+// which in turn requires 3 instead of 2 visualization generators per line.
+// This changes the number of pulses per page set - and therefore the stream
+// layout produced by the server. Without such a redesign, the latter approach
+// is the better fit.
+//
 
 #define DTY_MAX 36    // duty maximum (5.x bit resolution)
 #define CYC_MAX 46    // cycle maximum for pulse generator
@@ -175,11 +192,17 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #define SAVE_BUF 0x1F00   // stack save buffer
 #define PLAY_BUF 0x4000   // generated player
 
-#define VISU_BUF 0x10D8   // $D8 > GEN_MAX * GEN_NUM !!!
+#define VISU_BUF 0x10D8   // $D8 >= packed pulse generators per page !!!
 #define VISU_MAX 140      // lo:$10D8-$1ED8 hi:$40D8-$BED8
 #define VISU_L2H 13       // point to switch from lo to hi
 #define VISU_NUM 40       // number of visualization bytes
 
+#define PULSE_RATE 22050L  // pulses (aka samples) per second
+#define PULSE_NTSC 22184L  // actual pulses per second on NTSC machines
+#define PULSE_PAL  22079L  // actual pulses per second on PAL machines
+#define PULSE_PAGE 255     // pulses (aka samples) per page
+#define PULSE_FILL 16      // pages to buffer before resuming after running dry
+
 #define LEAVE 0xD400
 
 #define HIRES_186 0x2BD0  // hires scanline 186
@@ -191,6 +214,7 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #define write_main()  (*(uint8_t *)0xC004 = 0)
 #define write_aux()   (*(uint8_t *)0xC005 = 0)
+#define vbl()         (*(uint8_t *)0xC019 & 0x80)
 #define mix_off()     (*(uint8_t *)0xC052 = 0)
 #define mix_on()      (*(uint8_t *)0xC053 = 0)
 
@@ -481,14 +505,21 @@ static void fix_eth(register struct ins *ins, uint8_t ofs)
 
 enum nxt {pull, store, done};
 
-static void gen_pulse(register uint8_t *ptr, register struct ins *ins,
-                      register uint8_t dty, uint8_t low)
+// The pulse generators of one index are packed at the same page offset right
+// after the longest generator of the previous index in both page sets. The
+// offsets are shared by both page sets to allow to switch between them. As the
+// offsets are only known after all generators are put, the jump target lo
+// bytes are put as placeholders and patched afterwards.
+
+static uint8_t gen_ofs[GEN_NUM];                    // page offset of index
+static uint8_t jmp_ofs[SET_NUM][GEN_NUM][DTY_MAX];  // page offset of jump lo
+
+static uint8_t gen_pulse(register uint8_t *ptr, register struct ins *ins,
+                         register uint8_t dty)
 {
   // aggressive loop unrolling here... 
 
-#ifndef NDEBUG
   uint8_t *org = ptr;
-#endif
   register uint8_t cyc;
   enum nxt nxt;
   uint16_t *loc;
@@ -613,7 +644,7 @@ static void gen_pulse(register uint8_t *ptr, register struct ins *ins,
   assert(jmp.len == 3);
   write_aux();
   *ptr++ = jmp.opc[0];
-  *ptr++ = low;
+  *ptr++ = jmp.opc[1];        // patched by gen_player()
   write_main();
   cyc += jmp.cyc;
 
@@ -630,14 +661,13 @@ static void gen_pulse(register uint8_t *ptr, register struct ins *ins,
   assert(ptr - org < GEN_MAX);  // no byte length overshoot
   assert(nxt == done);          // no next sample work left
   assert(!ins->opc[0]);         // no instruction left
+
+  return ptr + 1 - org;
 }
 
-static void gen_pulse_34(register uint8_t *ptr, register struct ins *ins,
-                         register uint8_t low)
+static uint8_t gen_pulse_34(register uint8_t *ptr, register struct ins *ins)
 {
-#ifndef NDEBUG
   uint8_t *org = ptr;
-#endif
   register uint8_t cyc;
   struct ins *ins_34;
   uint16_t *loc;
@@ -697,7 +727,7 @@ static void gen_pulse_34(register uint8_t *ptr, register struct ins *ins,
   assert(jmp.len == 3);
   write_aux();
   *ptr++ = jmp.opc[0];
-  *ptr++ = low;
+  *ptr++ = jmp.opc[1];        // patched by gen_player()
   cyc += jmp.cyc;
   write_main();
 
@@ -711,14 +741,18 @@ static void gen_pulse_34(register uint8_t *ptr, register struct ins *ins,
 #endif
   assert(cyc == CYC_MAX);       // no cycle count overshoot
   assert(ptr - org < GEN_MAX);  // no byte length overshoot
+
+  return ptr + 1 - org;
 }
 
 static const char spin[] = {'/', '-', '\\', '|'};
 
-void gen_player(uint8_t e_ini, bool t_out)
+bool gen_player(uint8_t e_ini, bool t_out)
 {
   uint8_t e_ofs = e_ini << 4;
   uint8_t s, g, d;
+  uint8_t ofs = 0;
+  register uint8_t *ptr;
 
   assert(&leave == (void(*)(void))LEAVE);
 
@@ -731,13 +765,14 @@ void gen_player(uint8_t e_ini, bool t_out)
   *(uint16_t *)SPKR_PTR = *(uint16_t *)&spkr_a.opc[1];
   *(uint16_t *)VISU_PTR = VISU_BUF;
 
-  for (s = 0; s < SET_NUM; ++s)
+  for (g = 0; g < GEN_NUM; ++g)
   {
-    uint8_t *s_ptr = (uint8_t *)PLAY_BUF + s * DTY_MAX * 0x0100;
+    uint8_t max = 0;
 
-    for (g = 0; g < GEN_NUM; ++g)
+    gen_ofs[g] = ofs;
+    for (s = 0; s < SET_NUM; ++s)
     {
-      uint8_t *g_ptr = s_ptr + g * GEN_MAX;
+      uint8_t *g_ptr = (uint8_t *)PLAY_BUF + s * DTY_MAX * 0x0100 + ofs;
       struct flow *f = &flow[s][g];
       uint8_t x = wherex();
 
@@ -746,54 +781,273 @@ void gen_player(uint8_t e_ini, bool t_out)
         fix_eth(f->ins, e_ofs);
         for (d = 0; d < DTY_MAX; ++d)
         {
+          uint8_t len;
+
           cputc(spin[d % sizeof(spin)]);
           gotox(x);
 
           if (d == 34)
           {
-            gen_pulse_34(g_ptr + d * 0x0100, f->ins, f->nxt * GEN_MAX);
+            len = gen_pulse_34(g_ptr + d * 0x0100, f->ins);
           }
           else
           {
-            gen_pulse(g_ptr + d * 0x0100, f->ins, d, f->nxt * GEN_MAX + GEN_END);
+            len = gen_pulse(g_ptr + d * 0x0100, f->ins, d);
+          }
+          jmp_ofs[s][g][d] = ofs + len - 2;
+          if (len > max)
+          {
+            max = len;
           }
         }
       }
       cputc('.');
     }
+
+    // no overlap with visualization, checked without wrapping the offset
+    if (max > (uint8_t)VISU_BUF - ofs)
+    {
+      return false;
+    }
+    ofs += max;
   }
+
+  // patch jump target lo bytes now that all generator offsets are known
+  for (s = 0; s < SET_NUM; ++s)
+  {
+    for (g = 0; g < GEN_NUM; ++g)
+    {
+      struct flow *f = &flow[s][g];
+
+      if (!f->ins)
+      {
+        continue;
+      }
+      for (d = 0; d < DTY_MAX; ++d)
+      {
+        uint8_t low = gen_ofs[f->nxt] + (d == 34 ? 0 : GEN_END);
+
+        ptr = (uint8_t *)PLAY_BUF + (s * DTY_MAX + d) * 0x0100 + jmp_ofs[s][g][d];
+        write_aux();
+
+        // Only - actual - register (aka zero page) variables here !!!
+        *ptr = low;
+
+        write_main();
+      }
+    }
+  }
+  return true;
 }
 
-enum state {waiting, loading, pausing, playing};
+enum pattern {level_meter, progress_bar};
+
+// visualization template parameters sent instead of the templates
+static struct param {
+  uint8_t pattern;
+  uint8_t pos;        // level meter center or progress bar start pixel
+  uint8_t len;        // number of pixels
+  uint8_t color[3];   // level meter low, mid, high or progress bar frame, done, head
+  uint8_t thres[2];   // level meter mid and high thresholds
+} param;
+
+// AUX template followed by MAIN template, the AUX template flag byte is
+// followed by the AUX half and the MAIN half of a DHGR line (see below)
+static uint8_t line[1 + VISU_NUM * 2];
+
+// The DHGR display encodes 7 pixels across interleaved
+// 4-byte sequences of AUX and MAIN memory, as follows:
+// 0BBBAAAA  0DDCCCCB  0FEEEEDD  0GGGGFFF
+// Aux N     Main N    Aux N+1   Main N+1  (N even)
+
+static const uint8_t shift[7][4] = {{ 0,  0,  0,  0},  // A
+                                    { 4,  4,  4,  5},  // B
+                                    { 9,  9,  9,  9},  // C
+                                    {13, 13, 14, 14},  // D
+                                    {18, 18, 18, 18},  // E
+                                    {22, 23, 23, 23},  // F
+                                    {27, 27, 27, 27}}; // G
+
+static const uint8_t offset[4] = {0, VISU_NUM, 1, VISU_NUM + 1};
+
+static void set_pixel(uint8_t pos, uint8_t color)
+{
+  uint8_t *ptr = line + 1 + pos / 7 * 2;
+  const uint8_t *s = shift[pos % 7];
+  uint8_t bit;
 
-char display[][] = {"Wait", "Load", "Paus"};
+  for (bit = 0; bit < 4; ++bit)
+  {
+    uint8_t b = bit + s[bit];
+    uint8_t *byte = ptr + offset[b >> 3];
+    uint8_t mask = 1 << (b & 0x07);
+
+    if (color & 1 << bit)
+    {
+      *byte |= mask;
+    }
+    else
+    {
+      *byte &= ~mask;
+    }
+  }
+}
 
-void play(void)
+static uint8_t *store_template(register uint8_t *ptr, uint8_t v)
 {
-  uint8_t cya;
-  uint16_t skip;
-  enum state state = playing;
+  register uint8_t *src = line + (v & 1) * VISU_NUM;
+  register uint8_t i = VISU_NUM;
+
+  write_aux();
+
+  // Only - actual - register (aka zero page) variables here !!!
+  do
+  {
+    *ptr++ = *src++;
+  }
+  while (--i);
+
+  write_main();
 
+  if (v == VISU_L2H)
   {
-    uint8_t v;
-    uint8_t *v_ptr = (uint8_t *)VISU_BUF;
+    return (uint8_t *)VISU_BUF + 0x3000;
+  }
+  return ptr - VISU_NUM + 0x0100;
+}
+
+static bool load_templates(void)
+{
+  uint8_t v;
+  uint8_t *v_ptr = (uint8_t *)VISU_BUF;
 
-    for (v = 0; v < VISU_MAX; ++v)
+  for (v = 0; v < VISU_MAX; ++v)
+  {
+    if (!load(v_ptr, VISU_NUM, true))
     {
-      if (!load(v_ptr, VISU_NUM, true))
-      {
-        w5100_disconnect();
-        return;
-      }
-      if (v == VISU_L2H)
+      return false;
+    }
+    if (v == VISU_L2H)
+    {
+      v_ptr = (uint8_t *)VISU_BUF + 0x3000;
+    }
+    else
+    {
+      v_ptr += 0x0100;
+    }
+  }
+  return true;
+}
+
+// Generate the same templates as gena2stream
+static bool gen_templates(void)
+{
+  uint8_t v;
+  uint8_t pos;
+  uint8_t *v_ptr = (uint8_t *)VISU_BUF;
+
+  if (!load((uint8_t *)&param, sizeof(param), false))
+  {
+    return false;
+  }
+
+  memset(line, 0, sizeof(line));
+  line[0] = 1;  // first template is meant for AUX memory
+
+  if (param.pattern == progress_bar)
+  {
+    set_pixel(param.pos - 1,         param.color[0]);
+    set_pixel(param.pos + param.len, param.color[0]);
+  }
+
+  for (v = 0; v < VISU_MAX; v += 2)
+  {
+    pos = v / 2;
+
+    if (param.pattern == level_meter)
+    {
+      if (pos <= param.len)
       {
-        v_ptr = (uint8_t *)VISU_BUF + 0x3000;
+        uint8_t color = param.color[0];
+        if (pos > param.thres[0])
+        {
+          color = param.color[1];
+        }
+        if (pos > param.thres[1])
+        {
+          color = param.color[2];
+        }
+        set_pixel(param.pos - pos,     color);
+        set_pixel(param.pos + pos + 1, color);
       }
-      else
+    }
+    else
+    {
+      if (pos)
       {
-        v_ptr += 0x0100;
+        set_pixel(param.pos + pos - 1, param.color[1]);
       }
+      set_pixel(param.pos + pos, param.color[2]);
     }
+
+    v_ptr = store_template(v_ptr, v);
+    v_ptr = store_template(v_ptr, v + 1);
+  }
+  return true;
+}
+
+enum state {waiting, loading, pausing, playing};
+
+// Playback statistics sent to the server when quitting with Esc or after
+// the server closed its side of the connection at the end of the stream.
+// Sending them while the server is still sending the stream would leave
+// unread data in the server socket, which makes many servers reset the
+// connection when closing it and therefore cut off the end of the stream.
+static struct stats {
+  uint8_t  type[2];   // 0xA2 0x54
+  uint16_t underruns; // number of times the player ran dry
+  uint16_t waiting;   // time spent waiting for data in 1/120s (at least)
+  uint8_t  seeks;     // number of fast-forwards
+} stats;
+
+static void send_stats(void)
+{
+  uint8_t i;
+
+  if (w5100_send_request() < sizeof(stats))
+  {
+    return;
+  }
+  for (i = 0; i < sizeof(stats); ++i)
+  {
+    *w5100_data = ((uint8_t *)&stats)[i];
+  }
+  w5100_send_commit(sizeof(stats));
+}
+
+char display[][] = {"Wait", "Load", "Paus"};
+
+void play(bool gen_visu, bool report, uint8_t rate)
+{
+  uint8_t cya;
+  uint16_t skip;
+  uint32_t pulses;  // pulses (aka samples) per minute of the stream
+  enum state state = playing;
+  bool played = false;
+  uint8_t vbl_last = vbl();
+
+  memset(&stats, 0, sizeof(stats));
+  stats.type[0] = 0xA2;
+  stats.type[1] = 0x54;
+
+  // Samples resampled to the actual pulse rate have that many per second
+  pulses = 60 * (rate == RATE_NTSC ? PULSE_NTSC :
+                 rate == RATE_PAL  ? PULSE_PAL  : PULSE_RATE);
+
+  if (!(gen_visu ? gen_templates() : load_templates()))
+  {
+    w5100_disconnect();
+    return;
   }
 
   if (get_ostype() & APPLE_IIGS)
@@ -802,22 +1056,24 @@ void play(void)
     *(uint8_t *)0xC036 &= 0b01111111; // set normal speed
   }
 
-  while (w5100_connected())
+  // After the server closed the connection, play what's left
+  while (w5100_connected() || w5100_receive_request() >= 0x0100)
   {
     if (kbhit())
     {
       char c = cgetc();
       if (c == CH_ESC)
       {
-        w5100_disconnect();
-        return;
+        break;
       }
       if (c >= '1' && c <= '9')
       {
         if (state != loading)
         {
           state = loading;
-          skip = 87 * 60 * (c - '0');
+          ++stats.seeks;
+          // Round to the page closest to the exact point in time
+          skip = ((c - '0') * pulses + PULSE_PAGE / 2) / PULSE_PAGE;
         }
       }
       else
@@ -839,12 +1095,14 @@ void play(void)
       {
         if (recv)
         {
-          w5100_receive_commit(recv << 8);
-          if (skip > recv)
+          // Don't skip beyond the target page
+          if (recv > skip)
           {
-            skip -= recv;
+            recv = skip;
           }
-          else
+          w5100_receive_commit(recv << 8);
+          skip -= recv;
+          if (!skip)
           {
             state = waiting;
           }
@@ -852,12 +1110,20 @@ void play(void)
       }
       else
       {
-        if (recv)
+        // After running dry, refill half of the 8kB W5100 buffer before
+        // resuming. Otherwise a stalled network results in an endless
+        // sequence of short bursts instead of a single gap. But there's
+        // no point in waiting for more data once the server is done.
+        if (recv >= (state == waiting && w5100_connected() ? PULSE_FILL : 1))
         {
           state = playing;
         }
         else
         {
+          if (state == playing && played)
+          {
+            ++stats.underruns;
+          }
           state = waiting;
         }
       }
@@ -866,14 +1132,28 @@ void play(void)
     {
       mix_off();
       enter();
+      played = true;
     }
     else
     {
+      if (state == waiting && vbl() != vbl_last)
+      {
+        vbl_last ^= 0x80;
+        ++stats.waiting;
+      }
       mix_on();
       cputsxy(35, 22, display[state]);
     }
   }
 
+  // After the end of the stream, the server can still receive on its side
+  // of the connection
+  if (report)
+  {
+    send_stats();
+  }
+  w5100_disconnect();
+
   if (get_ostype() & APPLE_IIGS)
   {
     *(uint8_t *)0xC036 = cya;
@@ -36,8 +36,12 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include <stdint.h>
 
-void gen_player(uint8_t e_ini, bool t_out);
+bool gen_player(uint8_t e_ini, bool t_out);
 
-void play(void);
+// Stream type flags for samples resampled to the pulse rate of a machine
+#define RATE_NTSC 0x20
+#define RATE_PAL  0x40
+
+void play(bool gen_visu, bool report, uint8_t rate);
 
 #endif